@@ -1,119 +1,359 @@
 #include "capture.h"
+#include "notify.h"
+#include "route.h"
 #include "util.h"
 #include "uwsgiwrap.h"
 #include "v4l.h"
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
-static capture_context cmdline_ctx = {.quality = 80,
-                                      .fps = 255,
-                                      .name = "Unknown",
-                                      .path = NULL,
-                                      .resolution = {640, 480}};
+static capture_context cmdline_ctx = {.source = CAPTURE_SOURCE_V4L};
+static capture_config cmdline_config = {.quality = 80,
+                                        .fps = 255,
+                                        .decode_scale = 1,
+                                        .name = "Unknown",
+                                        .path = NULL,
+                                        .resolution = {640, 480}};
 
-static capture_context *capture_contexts = NULL;
+static struct uwsgi_string_list *v4l_devices = NULL;
+static struct uwsgi_string_list *remote_sources = NULL;
+static struct uwsgi_string_list *mosaics = NULL;
+static struct uwsgi_string_list *crops = NULL;
+
+// Contexts never move once added, so pointers to them stay good until they're
+// removed. Slots freed by removing a context are reused, so contexts that
+// mosaics or crops are built from can't be removed.
+static capture_context capture_contexts[CAPTURE_MAX_CONTEXTS];
 static struct uwsgi_lock_item *capture_lock;
+// one past the last slot in use
 static uint8_t contexts_length = 0;
-static uint8_t contexts_size = 0;
 
+// the slot of the context called name, or -1; called with capture_lock held
+static int capture_ctx_named(char *name) {
+  for (uint8_t i = 0; i < contexts_length; i++) {
+    if (capture_contexts[i].sa != NULL &&
+        strcmp(capture_contexts[i].config->name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Names have to be unique for routes to find contexts by them. Identical
+// devices report the same card name, so those get told apart by their slot;
+// names that were picked on purpose have to be unique to begin with.
+static int capture_ctx_unique_name(capture_context *ctx, uint8_t idx) {
+  capture_config *config = ctx->config;
+  if (capture_ctx_named(config->name) < 0) {
+    return 0;
+  }
+  if (ctx->source != CAPTURE_SOURCE_V4L) {
+    uwsgi_log("capture context %s reuses the name of another context\n",
+              config->name);
+    return -1;
+  }
+
+  char *num = uwsgi_num2str(idx);
+  char *name = uwsgi_concat3(config->name, "-", num);
+  free(num);
+  if (capture_ctx_named(name) >= 0) {
+    uwsgi_log("capture context %s reuses the name of another context\n",
+              name);
+    free(name);
+    return -1;
+  }
+  uwsgi_log("renamed %s to %s, its name is taken\n", config->name, name);
+  free(config->name);
+  config->name = name;
+  return 0;
+}
+
+// The context takes over its config, keeping a copy of its name that
+// initializing it may replace. If it can't be added, the config is freed.
 int add_capture_ctx(capture_context *ctx) {
-  int ret = capture_ctx_v4l_init(ctx);
+  ctx->config->name = strdup(ctx->config->name);
+  int ret;
+  switch (ctx->source) {
+  case CAPTURE_SOURCE_REMOTE:
+    ret = capture_ctx_remote_init(ctx);
+    break;
+  case CAPTURE_SOURCE_MOSAIC:
+    ret = capture_ctx_mosaic_init(ctx);
+    break;
+  case CAPTURE_SOURCE_CROP:
+    ret = capture_ctx_crop_init(ctx);
+    break;
+  default:
+    ret = capture_ctx_v4l_init(ctx);
+    break;
+  }
   if (ret < 0) {
+    free(ctx->config->controls);
+    free(ctx->config->name);
+    free(ctx->config);
     return ret;
   }
 
   uwsgi_wlock(capture_lock);
-  if (contexts_length == contexts_size) {
-    uint8_t new_size = (contexts_size == 0) ? 1 : (contexts_size * 2);
-    capture_context *new_buf = (capture_context *)realloc(
-        capture_contexts, new_size * sizeof(capture_context));
-    if (new_buf == NULL) {
-      uwsgi_rwunlock(capture_lock);
-      uwsgi_error("could not realloc() capture contexts array");
-      return -1;
-    }
-    capture_contexts = new_buf;
-    contexts_size = new_size;
+  uint8_t idx = 0;
+  while (idx < contexts_length && capture_contexts[idx].sa != NULL) {
+    idx++;
+  }
+  if (idx == CAPTURE_MAX_CONTEXTS) {
+    uwsgi_rwunlock(capture_lock);
+    uwsgi_log("can't have more than %d capture contexts\n",
+              CAPTURE_MAX_CONTEXTS);
+    capture_ctx_v4l_shutdown(ctx);
+    capture_ctx_free(ctx);
+    return -1;
+  }
+  if (capture_ctx_unique_name(ctx, idx) < 0) {
+    uwsgi_rwunlock(capture_lock);
+    capture_ctx_v4l_shutdown(ctx);
+    capture_ctx_free(ctx);
+    return -1;
   }
-  uint8_t idx = contexts_length++;
   capture_contexts[idx] = *ctx;
+  if (idx == contexts_length) {
+    contexts_length++;
+  }
   uwsgi_rwunlock(capture_lock);
   return idx;
 }
 
+capture_context *capture_ctx_get(uint8_t id) {
+  uwsgi_rlock(capture_lock);
+  capture_context *ctx = NULL;
+  if (id < contexts_length && capture_contexts[id].sa != NULL) {
+    ctx = &capture_contexts[id];
+  }
+  uwsgi_rwunlock(capture_lock);
+  return ctx;
+}
+
+// Look a context up by its name, which for a device is the card's name. If
+// hint isn't NULL, the slot it points to is tried first and updated with
+// wherever the context was found, so repeated lookups skip the search.
+capture_context *capture_ctx_find(char *name, uint8_t *hint) {
+  uwsgi_rlock(capture_lock);
+  capture_context *ctx = NULL;
+  int idx;
+  if (hint != NULL && *hint < contexts_length &&
+      capture_contexts[*hint].sa != NULL &&
+      strcmp(capture_contexts[*hint].config->name, name) == 0) {
+    ctx = &capture_contexts[*hint];
+  } else if ((idx = capture_ctx_named(name)) >= 0) {
+    ctx = &capture_contexts[idx];
+    if (hint != NULL) {
+      *hint = idx;
+    }
+  }
+  uwsgi_rwunlock(capture_lock);
+  return ctx;
+}
+
+// whether a mosaic or crop takes its frames from context id
+static bool capture_ctx_used(uint8_t id) {
+  for (uint8_t i = 0; i < contexts_length; i++) {
+    capture_context *ctx = &capture_contexts[i];
+    if (ctx->sa == NULL) {
+      continue;
+    }
+    if (ctx->crop != NULL && ctx->crop->input == id) {
+      return true;
+    }
+    for (uint8_t j = 0; ctx->mosaic != NULL && j < ctx->mosaic->count; j++) {
+      if (ctx->mosaic->inputs[j] == id) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
 int remove_capture_ctx(uint8_t id) {
-  if (id >= contexts_length) {
+  uwsgi_wlock(capture_lock);
+  if (id >= contexts_length || capture_contexts[id].sa == NULL) {
+    uwsgi_rwunlock(capture_lock);
+    return -1;
+  }
+  if (capture_ctx_used(id)) {
+    uwsgi_rwunlock(capture_lock);
+    uwsgi_log("capture context %d is still used by a mosaic or crop\n", id);
     return -1;
   }
 
-  uwsgi_wlock(capture_lock);
-  int ret = capture_ctx_v4l_shutdown(&capture_contexts[id]);
+  capture_context *ctx = &capture_contexts[id];
+  int ret = capture_ctx_v4l_shutdown(ctx);
   if (ret != 0) {
     uwsgi_rwunlock(capture_lock);
     return ret;
   }
 
-  memmove(&capture_contexts[id], &capture_contexts[id + 1],
-          (--contexts_length - id) * sizeof(capture_context));
+  if (ctx->receiver != NULL && ctx->sa->fd >= 0) {
+    // another stream received through the same socket takes over waiting on it
+    for (uint8_t i = 0; i < contexts_length; i++) {
+      capture_context *other = &capture_contexts[i];
+      if (i != id && other->receiver != NULL &&
+          other->receiver->fd == ctx->sa->fd) {
+        other->sa->fd = ctx->sa->fd;
+        break;
+      }
+    }
+  }
+  capture_ctx_free(ctx);
+  memset(ctx, 0, sizeof(*ctx));
+  while (contexts_length > 0 &&
+         capture_contexts[contexts_length - 1].sa == NULL) {
+    contexts_length--;
+  }
   uwsgi_rwunlock(capture_lock);
   return 0;
 }
 
 static struct uwsgi_option capture_options[] = {
     {"v4l-device", required_argument, 0,
-     "capture from the specified v4l device", uwsgi_opt_set_str_and_add_mule,
-     &cmdline_ctx.path, 0},
+     "capture from the specified v4l device (can be repeated)",
+     uwsgi_opt_add_string_list_and_add_mule, &v4l_devices, 0},
+    {"capture-remote", required_argument, 0,
+     "receive frames relayed by another instance to the specified "
+     "[stream@]address (can be repeated)",
+     uwsgi_opt_add_string_list_and_add_mule, &remote_sources, 0},
+    {"capture-mosaic", required_argument, 0,
+     "compose a grid of other contexts given as <columns>:<id>,<id>,... where "
+     "ids count devices, then remotes, then mosaics, then crops (can be "
+     "repeated)",
+     uwsgi_opt_add_string_list_and_add_mule, &mosaics, 0},
+    {"capture-crop", required_argument, 0,
+     "cut a named region out of another context losslessly, given as "
+     "<name>=<id>:<x>,<y>,<width>x<height> (can be repeated)",
+     uwsgi_opt_add_string_list_and_add_mule, &crops, 0},
+    {"relay", required_argument, 0,
+     "relay every frame to the specified unix socket or udp address",
+     uwsgi_opt_set_str, &cmdline_config.relay_addr, 0},
+    {"relay-max-frame", required_argument, 0,
+     "largest relayed frame to accept, in bytes (default 1M)",
+     uwsgi_opt_set_int, &cmdline_config.relay_max_frame, 0},
     {"resolution", required_argument, 0, "resolution of the captured video",
-     uwsgi_opt_set_resolution, cmdline_ctx.resolution, 0},
+     uwsgi_opt_set_resolution, cmdline_config.resolution, 0},
     {"fps", required_argument, 0, "number of frames to generate per second",
-     uwsgi_opt_set_8bit, &cmdline_ctx.fps, 0},
+     uwsgi_opt_set_8bit, &cmdline_config.fps, 0},
     {"quality", required_argument, 0, "JPEG quality (0-100) of each frame",
-     uwsgi_opt_set_8bit, &cmdline_ctx.quality, 0},
+     uwsgi_opt_set_8bit, &cmdline_config.quality, 0},
+    {"buffers", required_argument, 0,
+     "number of capture buffers to share between capture and readers",
+     uwsgi_opt_set_8bit, &cmdline_config.buffers, 0},
+    {"memfd", no_argument, 0,
+     "capture into a memfd so frames can be served with sendfile()",
+     uwsgi_opt_true, &cmdline_config.memfd, 0},
+    {"decode", required_argument, 0,
+     "keep a decoded gray or yuv420 copy of each frame while it has "
+     "subscribers (expects frames no bigger than --resolution)",
+     uwsgi_opt_set_decode_format, &cmdline_config.decode_format, 0},
+    {"decode-scale", required_argument, 0,
+     "shrink decoded frames by a factor of 1, 2, 4, or 8",
+     uwsgi_opt_set_8bit, &cmdline_config.decode_scale, 0},
+    {"idle-timeout", required_argument, 0,
+     "stop streaming after this many seconds without anyone asking for frames",
+     uwsgi_opt_set_int, &cmdline_ctx.idle_timeout, 0},
+    {"bandwidth", required_argument, 0,
+     "adjust JPEG quality and frame rate to publish at most this many bytes "
+     "per second",
+     uwsgi_opt_set_64bit, &cmdline_config.bandwidth, 0},
+    {"history-size", required_argument, 0,
+     "keep up to this many bytes of recent frames in shared memory",
+     uwsgi_opt_set_64bit, &cmdline_config.history_size, 0},
+    {"history-seconds", required_argument, 0,
+     "keep up to this many seconds of recent frames in shared memory",
+     uwsgi_opt_set_int, &cmdline_config.history_seconds, 0},
+    {"record-dir", required_argument, 0,
+     "continuously record frames to segment files in the specified directory",
+     uwsgi_opt_set_str_and_add_record_mule, &cmdline_config.record_dir, 0},
+    {"record-segment", required_argument, 0,
+     "length in seconds of each recording segment (default 60)",
+     uwsgi_opt_set_int, &cmdline_config.record_segment, 0},
     /*{"led", required_argument, 0,
      "switch the LED \"on\", \"off\", let it \"blink\", or leave it up to the "
      "driver with \"auto\"",
      uwsgi_opt_set_ctrl_led, &cmdline_ctx.led, 0},*/
     {"tvnorm", required_argument, 0, "set TV-Norm pal, ntsc, or secam",
-     uwsgi_opt_set_ctrl_tvnorm, &cmdline_ctx.control_options.tvnorm, 0},
+     uwsgi_opt_set_ctrl_tvnorm, &cmdline_config.control_options.tvnorm, 0},
     {"br", required_argument, 0, "set image brightness (auto or integer)",
-     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_config.control_options.sh, 0},
     {"co", required_argument, 0, "set image contrast (integer)",
-     uwsgi_opt_set_ctrl_int, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int, &cmdline_config.control_options.sh, 0},
     {"sh", required_argument, 0, "set image sharpness (integer)",
-     uwsgi_opt_set_ctrl_int, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int, &cmdline_config.control_options.sh, 0},
     {"sa", required_argument, 0, "set image saturation (integer)",
-     uwsgi_opt_set_ctrl_int, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int, &cmdline_config.control_options.sh, 0},
     {"cb", required_argument, 0, "set color balance (auto or integer)",
-     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_config.control_options.sh, 0},
     {"wb", required_argument, 0, "set white balance (auto or integer)",
-     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_config.control_options.sh, 0},
     {"ex", required_argument, 0,
      "set exposure (auto, shutter-priority, aperture-priority, or integer)",
-     uwsgi_opt_set_ctrl_ex, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_ex, &cmdline_config.control_options.sh, 0},
     {"bk", required_argument, 0, "set backlight compensation (integer)",
-     uwsgi_opt_set_ctrl_int, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int, &cmdline_config.control_options.sh, 0},
     {"rot", required_argument, 0, "set image rotation (0-359)",
-     uwsgi_opt_set_ctrl_int, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int, &cmdline_config.control_options.sh, 0},
     {"hf", required_argument, 0, "set horizontal flip (true/false)",
-     uwsgi_opt_set_ctrl_bool, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_bool, &cmdline_config.control_options.sh, 0},
     {"vf", required_argument, 0, "set vertical flip (true/false)",
-     uwsgi_opt_set_ctrl_bool, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_bool, &cmdline_config.control_options.sh, 0},
     {"pl", required_argument, 0,
      "set power line filter (disabled, 50hz, 60hz, or auto)",
-     uwsgi_opt_set_ctrl_pl, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_pl, &cmdline_config.control_options.sh, 0},
     {"gain", required_argument, 0, "set gain (auto or integer)",
-     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_config.control_options.sh, 0},
     {"cagc", required_argument, 0, "set chroma gain control (auto or integer)",
-     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_ctx.control_options.sh, 0},
+     uwsgi_opt_set_ctrl_int_or_auto, &cmdline_config.control_options.sh, 0},
     {NULL, 0, 0, NULL, NULL, NULL, 0}};
 
+// every context starts out with the settings given on the command line
+static int add_cmdline_ctx(uint8_t source, char *path) {
+  capture_context ctx = cmdline_ctx;
+  ctx.source = source;
+  ctx.config = (capture_config *)uwsgi_malloc(sizeof(capture_config));
+  *ctx.config = cmdline_config;
+  ctx.config->path = path;
+  return add_capture_ctx(&ctx);
+}
+
 static int capture_init() {
   capture_lock = uwsgi_rwlock_init("capture_contexts");
   if (capture_lock == NULL) {
     uwsgi_fatal_error("could not initialize lock for list of capture contexts");
   }
 
-  if (cmdline_ctx.path != NULL && add_capture_ctx(&cmdline_ctx) < 0) {
-    exit(1);
+  struct uwsgi_string_list *usl;
+  uwsgi_foreach(usl, v4l_devices) {
+    if (add_cmdline_ctx(CAPTURE_SOURCE_V4L, usl->value) < 0) {
+      exit(1);
+    }
+  }
+
+  uwsgi_foreach(usl, remote_sources) {
+    if (add_cmdline_ctx(CAPTURE_SOURCE_REMOTE, usl->value) < 0) {
+      exit(1);
+    }
+  }
+
+  uwsgi_foreach(usl, mosaics) {
+    if (add_cmdline_ctx(CAPTURE_SOURCE_MOSAIC, usl->value) < 0) {
+      exit(1);
+    }
+  }
+
+  uwsgi_foreach(usl, crops) {
+    if (add_cmdline_ctx(CAPTURE_SOURCE_CROP, usl->value) < 0) {
+      exit(1);
+    }
+  }
+
+  if (contexts_length > 0) {
+    capture_notify_init();
   }
   return 0;
 }
@@ -130,7 +370,35 @@ int capture_loop() {
   return 0;
 }
 
+int capture_record_loop() {
+  capture_recorder *recorders[CAPTURE_MAX_CONTEXTS];
+  capture_history *histories[CAPTURE_MAX_CONTEXTS];
+  while (true) {
+    // don't hold the list of contexts locked while waiting on the disk
+    uint8_t n = 0;
+    uwsgi_rlock(capture_lock);
+    for (uint8_t i = 0; i < contexts_length; i++) {
+      capture_context *ctx = &capture_contexts[i];
+      if (ctx->recorder != NULL) {
+        recorders[n] = ctx->recorder;
+        histories[n++] = ctx->history;
+      }
+    }
+    uwsgi_rwunlock(capture_lock);
+
+    for (uint8_t i = 0; i < n; i++) {
+      capture_recorder_process(recorders[i], histories[i]);
+    }
+    usleep(RECORD_POLL_INTERVAL);
+  }
+  return 0;
+}
+
 struct uwsgi_plugin capture_plugin = {
-    .name = "capture", .options = capture_options, .init = capture_init
-    // capture_loop is automatically added as a mule in util.c
+    .name = "capture",
+    .options = capture_options,
+    .on_load = capture_register_routers,
+    .init = capture_init
+    // capture_loop and capture_record_loop are automatically added as mules
+    // in util.c
 };
@@ -3,6 +3,11 @@
 #include "v4l.h"
 #include <stdint.h>
 
+#define CAPTURE_MAX_CONTEXTS 64
+
 int add_capture_ctx(capture_context *ctx);
 int remove_capture_ctx(uint8_t id);
+capture_context *capture_ctx_get(uint8_t id);
+capture_context *capture_ctx_find(char *name, uint8_t *hint);
 int capture_loop();
+int capture_record_loop();
@@ -52,6 +52,7 @@ int v4l_get_control(capture_context *ctx, unsigned int id) {
 }
 
 int v4l_set_control(capture_context *ctx, unsigned int id, int value) {
+  capture_config *config = ctx->config;
   int ret = is_v4l_control(ctx, id);
   if (ret < 0) {
     uwsgi_log("tried to set invalid control id 0x%08x\n", id);
@@ -59,9 +60,9 @@ int v4l_set_control(capture_context *ctx, unsigned int id, int value) {
   }
 
   v4l_control_meta *ctrl = NULL;
-  for (int i = 0; i < ctx->control_count; i++) {
-    if (ctx->controls[i].ctrl.id == id) {
-      ctrl = &ctx->controls[i];
+  for (int i = 0; i < config->control_count; i++) {
+    if (config->controls[i].ctrl.id == id) {
+      ctrl = &config->controls[i];
       break;
     }
   }
@@ -159,51 +160,74 @@ int v4l_reset_control(capture_context *ctx, unsigned int id) {
   return 0;
 }
 
-static void v4l_add_control(capture_context *ctx, struct v4l2_queryctrl *ctrl) {
-  struct v4l2_control c;
-  memset(&c, 0, sizeof(c));
-  c.id = ctrl->id;
-
-  ctx->controls = (v4l_control_meta *)realloc(
-      ctx->controls, (ctx->control_count + 1) * sizeof(ctx->controls[0]));
-  if (ctx->controls == NULL) {
-    uwsgi_fatal_error("realloc() failed");
-  }
-
-  ctx->controls[ctx->control_count].ctrl = *ctrl;
-  ctx->controls[ctx->control_count].value = c.value;
-  /*if (ctrl->type == V4L2_CTRL_TYPE_MENU) {
-    ctx->controls[ctx->control_count].menuitems = (struct v4l2_querymenu
-  *)malloc( (ctrl->maximum + 1) * sizeof(struct v4l2_querymenu)); int i; for (i
-  = ctrl->minimum; i <= ctrl->maximum; i++) { struct v4l2_querymenu qm;
-      memset(&qm, 0, sizeof(struct v4l2_querymenu));
-      qm.id = ctrl->id;
-      qm.index = i;
-      if (xioctl(ctx->sa->fd, VIDIOC_QUERYMENU, &qm) == 0) {
-        memcpy(&ctx->in_parameters[ctx->control_count].menuitems[i], &qm,
-               sizeof(struct v4l2_querymenu));
-        DBG("Menu item %d: %s\n", qm.index, qm.name);
-      } else {
-        DBG("Unable to get menu item for %s, index=%d\n", ctrl->name, qm.index);
+typedef struct {
+  // the context whose controls are being walked
+  capture_context *ctx;
+  int count;
+  int menu_items;
+  struct v4l2_querymenu *next_menu;
+} control_arena;
+
+typedef void (*control_visitor)(struct v4l2_queryctrl *ctrl,
+                                control_arena *arena);
+
+static bool v4l_has_menu(struct v4l2_queryctrl *ctrl) {
+  return (ctrl->type == V4L2_CTRL_TYPE_MENU ||
+          ctrl->type == V4L2_CTRL_TYPE_INTEGER_MENU) &&
+         ctrl->minimum >= 0 && ctrl->minimum <= ctrl->maximum;
+}
+
+static void v4l_count_control(struct v4l2_queryctrl *ctrl,
+                              control_arena *arena) {
+  arena->count++;
+  if (v4l_has_menu(ctrl)) {
+    arena->menu_items += ctrl->maximum + 1;
+  }
+}
+
+static void v4l_add_control(struct v4l2_queryctrl *ctrl,
+                            control_arena *arena) {
+  capture_context *ctx = arena->ctx;
+  capture_config *config = ctx->config;
+  if (config->control_count == arena->count) {
+    // the driver grew a control since we counted them
+    return;
+  }
+
+  v4l_control_meta *meta = &config->controls[config->control_count];
+  meta->ctrl = *ctrl;
+  meta->value = 0;
+  meta->menuitems = NULL;
+  if (v4l_has_menu(ctrl) && arena->menu_items >= ctrl->maximum + 1) {
+    // menu items are indexed by value, and the values can have gaps in them
+    meta->menuitems = arena->next_menu;
+    arena->next_menu += ctrl->maximum + 1;
+    arena->menu_items -= ctrl->maximum + 1;
+    for (int i = ctrl->minimum; i <= ctrl->maximum; i++) {
+      struct v4l2_querymenu *qm = &meta->menuitems[i];
+      qm->id = ctrl->id;
+      qm->index = i;
+      if (xioctl(ctx->sa->fd, VIDIOC_QUERYMENU, qm) < 0) {
+        memset(qm, 0, sizeof(*qm));
       }
     }
-  } else {*/
-  ctx->controls[ctx->control_count].menuitems = NULL;
-  /*}*/
+  }
 
-  ctx->controls[ctx->control_count].value = 0;
-  ctx->controls[ctx->control_count].class_id = (ctrl->id & 0xFFFF0000);
+  meta->class_id = (ctrl->id & 0xFFFF0000);
 #ifndef V4L2_CTRL_FLAG_NEXT_CTRL
-  ctx->controls[ctx->control_count].class_id = V4L2_CTRL_CLASS_USER;
+  meta->class_id = V4L2_CTRL_CLASS_USER;
 #endif
 
   int ret = -1;
-  if (ctx->controls[ctx->control_count].class_id == V4L2_CTRL_CLASS_USER) {
+  if (meta->class_id == V4L2_CTRL_CLASS_USER) {
+    struct v4l2_control c;
+    memset(&c, 0, sizeof(c));
+    c.id = ctrl->id;
     ret = xioctl(ctx->sa->fd, VIDIOC_G_CTRL, &c);
     if (ret < 0) {
       uwsgi_log("unable to get the value of control %s", ctrl->name);
     } else {
-      ctx->controls[ctx->control_count].value = c.value;
+      meta->value = c.value;
     }
   } else {
     struct v4l2_ext_controls ext_ctrls;
@@ -213,7 +237,7 @@ static void v4l_add_control(capture_context *ctx, struct v4l2_queryctrl *ctrl) {
     ext_ctrl.id = ctrl->id;
 #ifdef V4L2_CTRL_TYPE_STRING
     ext_ctrl.size = 0;
-    if (ctrl.type == V4L2_CTRL_TYPE_STRING) {
+    if (ctrl->type == V4L2_CTRL_TYPE_STRING) {
       ext_ctrl.size = ctrl->maximum + 1;
       // FIXMEEEEext_ctrl.string = control->string;
     }
@@ -224,13 +248,13 @@ static void v4l_add_control(capture_context *ctx, struct v4l2_queryctrl *ctrl) {
     if (ret) {
       switch (ext_ctrl.id) {
       case V4L2_CID_PAN_RESET:
-        ctx->controls[ctx->control_count].value = 1;
+        meta->value = 1;
         break;
       case V4L2_CID_TILT_RESET:
-        ctx->controls[ctx->control_count].value = 1;
+        meta->value = 1;
         break;
       /*case V4L2_CID_PANTILT_RESET_LOGITECH:
-        ctx->controls[ctx->control_count].value = 3;
+        meta->value = 3;
         DBG("Setting the PAN/TILT reset value to 3\n");
         break;*/
       default:
@@ -243,29 +267,28 @@ static void v4l_add_control(capture_context *ctx, struct v4l2_queryctrl *ctrl) {
       case V4L2_CTRL_TYPE_STRING:
         // string gets set on VIDIOC_G_EXT_CTRLS
         // add the maximum size to value
-        ctx->controls[ctx->control_count].value = ext_ctrl.size;
+        meta->value = ext_ctrl.size;
         break;
 #endif
       case V4L2_CTRL_TYPE_INTEGER64:
-        ctx->controls[ctx->control_count].value = ext_ctrl.value64;
+        meta->value = ext_ctrl.value64;
         break;
       default:
-        ctx->controls[ctx->control_count].value = ext_ctrl.value;
+        meta->value = ext_ctrl.value;
         break;
       }
     }
   }
 
-  ctx->control_count++;
+  config->control_count++;
 }
 
-void v4l_enumerate_controls(capture_context *ctx) {
+static void v4l_walk_controls(capture_context *ctx, control_visitor visit,
+                              control_arena *arena) {
   struct v4l2_queryctrl ctrl;
   memset(&ctrl, 0, sizeof(ctrl));
+  arena->ctx = ctx;
 
-  ctx->control_count = 0;
-  free(ctx->controls);
-  ctx->controls = NULL;
   // try the extended control API first
 #ifdef V4L2_CTRL_FLAG_NEXT_CTRL
   // note: use simple ioctl or v4l2_ioctl instead of the xioctl
@@ -273,7 +296,7 @@ void v4l_enumerate_controls(capture_context *ctx) {
   int ret = -1;
   if (ioctl(ctx->sa->fd, VIDIOC_QUERYCTRL, &ctrl) == 0) {
     do {
-      v4l_add_control(ctx, &ctrl);
+      visit(&ctrl, arena);
       ctrl.id |= V4L2_CTRL_FLAG_NEXT_CTRL;
     } while (ioctl(ctx->sa->fd, VIDIOC_QUERYCTRL, &ctrl) == 0);
   } else
@@ -285,7 +308,7 @@ void v4l_enumerate_controls(capture_context *ctx) {
     for (int i = V4L2_CID_BASE; i < V4L2_CID_LASTP1; i++) {
       ctrl.id = i;
       if (ioctl(ctx->sa->fd, VIDIOC_QUERYCTRL, &ctrl) == 0) {
-        v4l_add_control(ctx, &ctrl);
+        visit(&ctrl, arena);
       }
     }
 
@@ -296,25 +319,140 @@ void v4l_enumerate_controls(capture_context *ctx) {
       if (ret < 0) {
         break;
       }
-      v4l_add_control(ctx, &ctrl);
+      visit(&ctrl, arena);
+    }
+  }
+}
+
+// Controls are counted first so that they and all of their menu items can
+// share one allocation.
+void v4l_enumerate_controls(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  control_arena arena;
+  memset(&arena, 0, sizeof(arena));
+  v4l_walk_controls(ctx, v4l_count_control, &arena);
+
+  free(config->controls);
+  config->controls = NULL;
+  config->control_count = 0;
+  if (arena.count == 0) {
+    return;
+  }
+
+  config->controls = (v4l_control_meta *)uwsgi_calloc(
+      arena.count * sizeof(v4l_control_meta) +
+      arena.menu_items * sizeof(struct v4l2_querymenu));
+  arena.next_menu = (struct v4l2_querymenu *)&config->controls[arena.count];
+  v4l_walk_controls(ctx, v4l_add_control, &arena);
+}
+
+// Set the quality of the device's JPEG encoder, through the JPEG control class
+// if the driver has it or the older VIDIOC_S_JPEGCOMP otherwise.
+int v4l_set_quality(capture_context *ctx, int quality) {
+  capture_config *config = ctx->config;
+  for (int i = 0; i < config->control_count; i++) {
+    if (config->controls[i].ctrl.id == V4L2_CID_JPEG_COMPRESSION_QUALITY) {
+      return v4l_set_control(ctx, V4L2_CID_JPEG_COMPRESSION_QUALITY, quality);
+    }
+  }
+
+  struct v4l2_jpegcompression jc;
+  memset(&jc, 0, sizeof(jc));
+  if (xioctl(ctx->sa->fd, VIDIOC_G_JPEGCOMP, &jc) < 0) {
+    return -1;
+  }
+  jc.quality = quality;
+  if (xioctl(ctx->sa->fd, VIDIOC_S_JPEGCOMP, &jc) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+// Track the bytes per second being published and steer them towards the
+// configured budget: quality goes down first if the device lets us change it,
+// then frames are skipped, and both are undone in reverse once there's room
+// again. Returns whether a frame of the given size should be published.
+bool v4l_adapt_quality(capture_context *ctx, uint32_t used, uint64_t now) {
+  capture_config *config = ctx->config;
+  capture_rate *r = ctx->rate;
+  if (r->skip > 0 && r->skipped++ % (r->skip + 1) != 0) {
+    return false;
+  }
+
+  r->window_bytes += used;
+  if (r->window_start == 0) {
+    r->window_start = now;
+  }
+  if (now - r->window_start < RATE_WINDOW) {
+    return true;
+  }
+
+  r->rate = r->window_bytes * 1000000 / (now - r->window_start);
+  r->window_start = now;
+  r->window_bytes = 0;
+
+  int quality = r->quality;
+  if (r->rate > r->budget + r->budget / 20) {
+    if (r->quality > RATE_MIN_QUALITY && !r->fixed_quality) {
+      // step harder the further over budget we are
+      int step = RATE_QUALITY_STEP * r->rate / r->budget;
+      quality = r->quality - step;
+      if (quality < RATE_MIN_QUALITY) {
+        quality = RATE_MIN_QUALITY;
+      }
+    } else if (r->skip < RATE_MAX_SKIP) {
+      r->skip++;
+    }
+  } else if (r->rate < r->budget - r->budget / 5) {
+    if (r->skip > 0) {
+      r->skip--;
+    } else if (r->quality < config->quality && !r->fixed_quality) {
+      quality = r->quality + RATE_QUALITY_STEP;
+      if (quality > config->quality) {
+        quality = config->quality;
+      }
     }
   }
+
+  if (quality == r->quality) {
+    return true;
+  }
+  if (v4l_set_quality(ctx, quality) == 0) {
+    r->quality = quality;
+  } else {
+    // don't retry every window, and start skipping right away instead
+    uwsgi_log("Device %s doesn't support setting JPEG quality, skipping "
+              "frames to stay within budget\n",
+              config->path);
+    r->fixed_quality = true;
+    if (quality < r->quality && r->skip < RATE_MAX_SKIP) {
+      r->skip++;
+    }
+  }
+  return true;
 }
 
 #define V4L_OPT_SET(vid, var, desc)                                            \
-  if (ctx->control_options.var.set) {                                          \
-    ret = v4l_set_control(ctx, vid, ctx->control_options.var.value);           \
+  if (config->control_options.var.set) {                                       \
+    ret = v4l_set_control(ctx, vid, config->control_options.var.value);        \
     if (ret == 0) {                                                            \
-      uwsgi_log("set " desc " of %s to %d\n", ctx->name,                       \
-                ctx->control_options.var.value);                               \
+      uwsgi_log("set " desc " of %s to %d\n", config->name,                    \
+                config->control_options.var.value);                            \
     } else {                                                                   \
       uwsgi_log("Failed to set " desc "\n");                                   \
     }                                                                          \
   }
 
 int v4l_setup_controls(capture_context *ctx) {
+  capture_config *config = ctx->config;
   int ret;
 
+  if (v4l_set_quality(ctx, config->quality) == 0) {
+    uwsgi_log("set JPEG quality of %s to %d\n", config->name, config->quality);
+  } else {
+    uwsgi_log("Device %s doesn't support setting JPEG quality\n", config->path);
+  }
+
   V4L_OPT_SET(V4L2_CID_SHARPNESS, sh, "sharpness")
   V4L_OPT_SET(V4L2_CID_CONTRAST, co, "contrast")
   V4L_OPT_SET(V4L2_CID_SATURATION, sa, "saturation")
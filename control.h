@@ -6,5 +6,8 @@ int v4l_get_control(capture_context *ctx, unsigned int id);
 int v4l_set_control(capture_context *ctx, unsigned int id, int value);
 int v4l_reset_control(capture_context *ctx, unsigned int id);
 
+int v4l_set_quality(capture_context *ctx, int quality);
+bool v4l_adapt_quality(capture_context *ctx, uint32_t used, uint64_t now);
+
 int v4l_setup_controls(capture_context *ctx);
 void v4l_enumerate_controls(capture_context *ctx);
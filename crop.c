@@ -0,0 +1,119 @@
+#include "crop.h"
+#include "capture.h"
+#include "jpeg.h"
+#include "pool.h"
+#include "uwsgiwrap.h"
+#include "v4l.h"
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A crop context's path is "<name>=<id>:<x>,<y>,<width>x<height>", naming the
+// context to cut the region out of by its position in the list of contexts.
+// Routes can then refer to the crop by its name.
+int capture_ctx_crop_init(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  capture_crop *c = (capture_crop *)uwsgi_calloc_shared(sizeof(capture_crop));
+  char *spec = config->path;
+  char *region = strchr(spec, '=');
+  int id;
+  if (region == NULL ||
+      sscanf(region + 1, "%d:%" SCNu32 ",%" SCNu32 ",%" SCNu32 "x%" SCNu32, &id,
+             &c->x, &c->y, &c->width, &c->height) != 5 ||
+      c->width == 0 || c->height == 0) {
+    uwsgi_log("invalid crop %s, expected "
+              "<name>=<id>:<x>,<y>,<width>x<height>\n",
+              spec);
+    return -1;
+  }
+
+  capture_context *input = capture_ctx_get(id);
+  if (input == NULL || input->pool == NULL) {
+    uwsgi_log("crop %s refers to unknown context %d\n", spec, id);
+    return -1;
+  }
+  // add_capture_ctx() turns it down if another context has the same name
+  c->input = id;
+  free(config->name);
+  config->name = uwsgi_concat2n(spec, region - spec, "", 0);
+
+  config->buffers = capture_pool_buffers(config->buffers);
+
+  // a piece of a frame is never bigger than the whole thing
+  uint64_t frame_size = input->pool->slots[0].length;
+  ctx->pool = capture_pool_init(config->buffers);
+  char *area = (char *)uwsgi_malloc_shared(frame_size * config->buffers);
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    ctx->pool->slots[i].data = area + i * frame_size;
+    ctx->pool->slots[i].length = frame_size;
+  }
+
+  // the region grows to whole MCUs, which only the frames can tell us the
+  // size of, so leave room for the largest possible ones
+  config->resolution[0] = c->width + 2 * CROP_MAX_MCU;
+  config->resolution[1] = c->height + 2 * CROP_MAX_MCU;
+
+  ctx->sa = uwsgi_sharedarea_init_ptr(area, frame_size);
+  ctx->sa->fd = -1;
+  ctx->sa->honour_used = 1;
+  ctx->pool->lock = ctx->sa->lock;
+  ctx->crop = c;
+  capture_ctx_init_outputs(ctx);
+
+  uwsgi_log("cropping %s out of context %d into sharedarea %d\n", config->name,
+            id, ctx->sa->id);
+  return 0;
+}
+
+// Cut the region out of the input's latest frame if it has a new one and anyone
+// has asked for the crop lately. The
+// crop is published under the same sequence number and timestamp as the frame
+// it came from, so clients can match them up.
+int capture_ctx_crop_process(capture_context *ctx, capture_context *contexts,
+                             uint8_t length) {
+  capture_crop *c = ctx->crop;
+  // pinning the input's frames would keep it streaming for nobody
+  if (!capture_ctx_wanted(ctx) || c->input >= length ||
+      contexts[c->input].sa == NULL) {
+    return 0;
+  }
+  capture_context *input = &contexts[c->input];
+  capture_demand_touch(input->pool->demand);
+  if (input->sa->updates == c->seq) {
+    return 0;
+  }
+
+  int index = -1;
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    if (capture_pool_reclaimable(ctx->pool, i)) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    // every buffer is pinned
+    c->dropped++;
+    return 0;
+  }
+
+  capture_frame frame;
+  if (capture_frame_pin(input->pool, &frame) < 0) {
+    return 0;
+  }
+  c->seq = frame.seq;
+
+  pool_slot *slot = &ctx->pool->slots[index];
+  uint32_t used;
+  int ret = jpeg_crop(&frame, c->x, c->y, c->width, c->height, slot->data,
+                      slot->length, &used);
+  capture_frame_unpin(&frame);
+
+  if (ret < 0) {
+    c->dropped++;
+    return 0;
+  }
+  capture_ctx_publish(ctx, index, used, frame.seq, frame.timestamp);
+  return 0;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+// the largest MCU libjpeg can produce, 4x subsampling of 8x8 blocks
+#define CROP_MAX_MCU 32
+
+typedef struct {
+  uint8_t input;
+  uint32_t x, y, width, height;
+  uint64_t seq;
+  uint64_t dropped;
+} capture_crop;
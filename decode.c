@@ -0,0 +1,130 @@
+#include "decode.h"
+#include "jpeg.h"
+#include "notify.h"
+#include "pool.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+static uint64_t decoded_size(uint8_t format, uint32_t width,
+                             uint32_t height) {
+  uint64_t size = (uint64_t)width * height;
+  if (format == DECODE_YUV420) {
+    size += 2 * (uint64_t)((width + 1) / 2) * ((height + 1) / 2);
+  }
+  return size;
+}
+
+// width and height are the largest frame expected, before scaling
+capture_decoded *capture_decoded_init(uint8_t format, uint8_t scale,
+                                      uint32_t width, uint32_t height) {
+  if (scale != 1 && scale != 2 && scale != 4 && scale != 8) {
+    scale = 1;
+  }
+
+  capture_decoded *d =
+      (capture_decoded *)uwsgi_calloc_shared(sizeof(capture_decoded));
+  d->format = format;
+  d->scale = scale;
+  d->capacity = decoded_size(format, (width + scale - 1) / scale,
+                             (height + scale - 1) / scale);
+  d->demand = capture_demand_init();
+  // only start decoding once somebody asks
+  d->demand->last_demand = 0;
+
+  d->pool = capture_pool_init(DECODE_BUFFERS);
+  char *area = (char *)uwsgi_malloc_shared(d->capacity * DECODE_BUFFERS);
+  for (uint8_t i = 0; i < d->pool->count; i++) {
+    d->pool->slots[i].data = area + i * d->capacity;
+    d->pool->slots[i].length = d->capacity;
+  }
+
+  d->sa = uwsgi_sharedarea_init_ptr(area, d->capacity);
+  d->sa->fd = -1;
+  d->sa->honour_used = 1;
+  d->pool->lock = d->sa->lock;
+  return d;
+}
+
+void capture_decoded_free(capture_decoded *d) {
+  capture_demand_free(d->demand);
+  capture_pool_free(d->pool);
+  capture_free_shared(d, sizeof(*d));
+}
+
+// Decode a frame into a buffer nobody is reading, then make it the latest.
+// The lock is only held for the swap, never while decoding.
+void capture_decoded_update(capture_decoded *d, pool_slot *slot) {
+  if (!capture_decoded_wanted(d)) {
+    return;
+  }
+
+  int index = -1;
+  for (uint8_t i = 0; i < d->pool->count; i++) {
+    if (capture_pool_reclaimable(d->pool, i)) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    // every buffer is pinned
+    d->dropped++;
+    return;
+  }
+
+  pool_slot *out = &d->pool->slots[index];
+  uint32_t width, height;
+  if (jpeg_decode_planes(slot->data, slot->used, d->format, d->scale,
+                         out->data, out->length, &width, &height) < 0) {
+    d->dropped++;
+    return;
+  }
+  d->widths[index] = width;
+  d->heights[index] = height;
+
+  uwsgi_wlock(d->sa->lock);
+  out->used = decoded_size(d->format, width, height);
+  out->seq = slot->seq;
+  out->timestamp = slot->timestamp;
+  d->pool->latest = index;
+  d->sa->area = out->data;
+  d->sa->used = out->used;
+  d->sa->updates = slot->seq;
+  uwsgi_rwunlock(d->sa->lock);
+  capture_notify_publish(d->sa);
+}
+
+// keep frames being decoded for another DECODE_IDLE_TIMEOUT; nothing has to
+// be undone afterwards, so a worker dying mid-request leaves nothing behind
+void capture_decoded_touch(capture_decoded *d) {
+  capture_demand_touch(d->demand);
+}
+
+bool capture_decoded_wanted(capture_decoded *d) {
+  return !capture_demand_idle(d->demand, DECODE_IDLE_TIMEOUT);
+}
+
+// Pin the latest decoded frame and point planes into it, to be read in place
+// until capture_frame_unpin(). Fails if nothing has been decoded yet.
+int capture_decoded_pin(capture_decoded *d, capture_frame *frame,
+                        capture_planes *planes) {
+  capture_decoded_touch(d);
+  if (capture_frame_pin(d->pool, frame) < 0) {
+    return -1;
+  }
+
+  uint32_t width = d->widths[frame->index];
+  uint32_t height = d->heights[frame->index];
+  uint64_t luma = (uint64_t)width * height;
+  uint64_t chroma = (uint64_t)((width + 1) / 2) * ((height + 1) / 2);
+  planes->seq = frame->seq;
+  planes->width = width;
+  planes->height = height;
+  planes->y = frame->data;
+  planes->u = (d->format == DECODE_YUV420) ? frame->data + luma : NULL;
+  planes->v =
+      (d->format == DECODE_YUV420) ? frame->data + luma + chroma : NULL;
+  return 0;
+}
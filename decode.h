@@ -0,0 +1,58 @@
+#pragma once
+
+#include "demand.h"
+#include "pool.h"
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DECODE_NONE 0
+#define DECODE_GRAY 1
+#define DECODE_YUV420 2
+
+// one being read, one being decoded into and one to spare
+#define DECODE_BUFFERS 3
+// how long decoding carries on after the last request for decoded frames
+#define DECODE_IDLE_TIMEOUT 5000000
+
+// Raw pixels of the latest frame, decoded once in the capture mule for every
+// consumer to share. The planes are published as a sharedarea of their own
+// whose update counter matches the sequence number of the frame they came
+// from. Decoding only happens while somebody has asked for decoded frames
+// recently.
+//
+// The buffers form a pool just like the capture buffers: the mule decodes
+// into one nobody is reading and only takes the sharedarea lock to make it
+// the latest. Plain sharedarea readers copy the latest under the read lock,
+// and our own readers pin it and read it in place. If every buffer is busy
+// the frame just isn't decoded.
+typedef struct {
+  struct uwsgi_sharedarea *sa;
+  capture_pool *pool;
+  capture_demand *demand;
+  uint8_t format;
+  uint8_t scale;
+  uint64_t capacity;
+  uint32_t widths[DECODE_BUFFERS];
+  uint32_t heights[DECODE_BUFFERS];
+  uint64_t dropped;
+} capture_decoded;
+
+typedef struct {
+  uint64_t seq;
+  uint32_t width;
+  uint32_t height;
+  char *y;
+  char *u;
+  char *v;
+} capture_planes;
+
+capture_decoded *capture_decoded_init(uint8_t format, uint8_t scale,
+                                      uint32_t width, uint32_t height);
+void capture_decoded_free(capture_decoded *d);
+void capture_decoded_update(capture_decoded *d, pool_slot *slot);
+
+void capture_decoded_touch(capture_decoded *d);
+bool capture_decoded_wanted(capture_decoded *d);
+int capture_decoded_pin(capture_decoded *d, capture_frame *frame,
+                        capture_planes *planes);
@@ -0,0 +1,91 @@
+#include "demand.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static int wake_fd = -1;
+
+capture_demand *capture_demand_init() {
+  if (wake_fd < 0) {
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+      uwsgi_error("eventfd() failed");
+    }
+  }
+
+  capture_demand *d =
+      (capture_demand *)uwsgi_calloc_shared(sizeof(capture_demand));
+  d->last_demand = uwsgi_micros();
+  return d;
+}
+
+void capture_demand_free(capture_demand *d) {
+  capture_free_shared(d, sizeof(*d));
+}
+
+int capture_demand_wake_fd() { return wake_fd; }
+
+void capture_demand_touch(capture_demand *d) {
+  uint64_t now = uwsgi_micros();
+  __atomic_store_n(&d->last_demand, now, __ATOMIC_RELEASE);
+  if (!__atomic_load_n(&d->suspended, __ATOMIC_ACQUIRE)) {
+    return;
+  }
+
+  // only the first reader to notice needs to wake the mule
+  uint64_t expected = 0;
+  if (__atomic_compare_exchange_n(&d->resume_requested, &expected, now, false,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+      wake_fd >= 0) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) < 0) {
+      uwsgi_error("write() to capture wakeup eventfd failed");
+    }
+  }
+}
+
+void capture_demand_subscribe(capture_demand *d) {
+  __atomic_add_fetch(&d->subscribers, 1, __ATOMIC_RELEASE);
+  capture_demand_touch(d);
+}
+
+void capture_demand_unsubscribe(capture_demand *d) {
+  __atomic_sub_fetch(&d->subscribers, 1, __ATOMIC_RELEASE);
+  capture_demand_touch(d);
+}
+
+bool capture_demand_idle(capture_demand *d, uint64_t timeout) {
+  return __atomic_load_n(&d->subscribers, __ATOMIC_ACQUIRE) <= 0 &&
+         uwsgi_micros() -
+                 __atomic_load_n(&d->last_demand, __ATOMIC_ACQUIRE) >
+             timeout;
+}
+
+// Whether the latest frame was left over from before a suspension, with no
+// new one published since.
+bool capture_demand_stale(capture_demand *d) {
+  return __atomic_load_n(&d->suspended, __ATOMIC_ACQUIRE) ||
+         __atomic_load_n(&d->resume_requested, __ATOMIC_ACQUIRE) != 0;
+}
+
+void capture_demand_suspended(capture_demand *d, bool suspended) {
+  if (suspended) {
+    __atomic_store_n(&d->resume_requested, 0, __ATOMIC_RELEASE);
+    d->suspends++;
+  } else {
+    d->resumes++;
+  }
+  __atomic_store_n(&d->suspended, suspended, __ATOMIC_RELEASE);
+}
+
+// called for every new frame, to time how long resuming took
+void capture_demand_published(capture_demand *d, uint64_t timestamp) {
+  uint64_t requested =
+      __atomic_exchange_n(&d->resume_requested, 0, __ATOMIC_ACQ_REL);
+  if (requested != 0 && !d->suspended && timestamp > requested) {
+    d->resume_latency = timestamp - requested;
+  }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEMAND_POLL 250000
+
+// How much anyone wants a context's frames. Readers touch it whenever they
+// pin a frame and long-lived consumers hold a subscription; the capture mule
+// stops streaming once it's gone unwanted for a while, and readers wake it
+// back up through the shared eventfd.
+typedef struct {
+  int subscribers;
+  uint64_t last_demand;
+  bool suspended;
+  uint64_t resume_requested;
+  uint64_t resume_latency;
+  uint64_t suspends;
+  uint64_t resumes;
+} capture_demand;
+
+capture_demand *capture_demand_init();
+void capture_demand_free(capture_demand *d);
+int capture_demand_wake_fd();
+void capture_demand_touch(capture_demand *d);
+void capture_demand_subscribe(capture_demand *d);
+void capture_demand_unsubscribe(capture_demand *d);
+bool capture_demand_idle(capture_demand *d, uint64_t timeout);
+bool capture_demand_stale(capture_demand *d);
+void capture_demand_suspended(capture_demand *d, bool suspended);
+void capture_demand_published(capture_demand *d, uint64_t timestamp);
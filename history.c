@@ -0,0 +1,231 @@
+#include "history.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+capture_history *capture_history_init(uint64_t size, uint32_t max_frames,
+                                      uint64_t max_age) {
+  if (size == 0) {
+    size = HISTORY_DEFAULT_SIZE;
+  }
+  if (max_frames == 0) {
+    max_frames = size / HISTORY_MIN_FRAME_SIZE;
+  }
+
+  capture_history *h =
+      (capture_history *)uwsgi_calloc_shared(sizeof(capture_history));
+  h->arena = (char *)uwsgi_malloc_shared(size);
+  h->arena_size = size;
+  h->entries = (history_entry *)uwsgi_calloc_shared(max_frames *
+                                                    sizeof(history_entry));
+  h->entries_size = max_frames;
+  h->max_age = max_age;
+  h->lock = uwsgi_rwlock_init("capture_history");
+  if (h->lock == NULL) {
+    uwsgi_fatal_error("could not initialize lock for capture history");
+  }
+  return h;
+}
+
+// the lock stays behind, uwsgi has no way to give one back
+void capture_history_free(capture_history *h) {
+  capture_free_shared(h->entries, h->entries_size * sizeof(history_entry));
+  capture_free_shared(h->arena, h->arena_size);
+  capture_free_shared(h, sizeof(*h));
+}
+
+static history_entry *history_at(capture_history *h, uint32_t i) {
+  return &h->entries[(h->head + i) % h->entries_size];
+}
+
+static void history_evict(capture_history *h) {
+  h->head = (h->head + 1) % h->entries_size;
+  h->count--;
+}
+
+void capture_history_append(capture_history *h, char *frame, uint32_t len,
+                            uint64_t seq, uint64_t timestamp) {
+  uwsgi_wlock(h->lock);
+  if (len > h->arena_size) {
+    h->dropped++;
+    uwsgi_rwunlock(h->lock);
+    return;
+  }
+
+  uint64_t pos = h->count == 0 ? 0 : h->write_pos;
+  if (pos + len > h->arena_size) {
+    // frames never straddle the end of the arena; everything past the write
+    // position is older than anything before it, so it goes first
+    while (h->count > 0 && history_at(h, 0)->offset >= pos) {
+      history_evict(h);
+    }
+    pos = 0;
+  }
+
+  // the oldest frame always sits right after the write position, so only the
+  // head can overlap the region we're about to overwrite
+  while (h->count > 0) {
+    history_entry *e = history_at(h, 0);
+    if (h->count == h->entries_size ||
+        (e->offset < pos + len && e->offset + e->length > pos) ||
+        (h->max_age && timestamp - e->timestamp > h->max_age)) {
+      history_evict(h);
+    } else {
+      break;
+    }
+  }
+
+  memcpy(h->arena + pos, frame, len);
+  history_entry *e = history_at(h, h->count++);
+  e->seq = seq;
+  e->timestamp = timestamp;
+  e->offset = pos;
+  e->length = len;
+  h->write_pos = pos + len;
+  uwsgi_rwunlock(h->lock);
+}
+
+// index of the first frame captured at or after the given time
+static uint32_t history_search(capture_history *h, uint64_t timestamp) {
+  uint32_t lo = 0, hi = h->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (history_at(h, mid)->timestamp < timestamp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+// Copy out the metadata of up to max frames newer than after_seq. The frame
+// data stays in the arena; callers that read it without holding the lock must
+// check capture_history_contains() once they're done reading, and throw away
+// what they read if it was overwritten in the meantime.
+uint32_t capture_history_collect(capture_history *h, uint64_t after_seq,
+                                history_entry *out, uint32_t max) {
+  uwsgi_rlock(h->lock);
+  uint32_t lo = 0, hi = h->count;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (history_at(h, mid)->seq <= after_seq) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  uint32_t n = 0;
+  for (uint32_t i = lo; i < h->count && n < max; i++) {
+    out[n++] = *history_at(h, i);
+  }
+  uwsgi_rwunlock(h->lock);
+  return n;
+}
+
+// Frames are evicted oldest first, so if seq is still in the ring then so is
+// everything captured after it.
+bool capture_history_contains(capture_history *h, uint64_t seq) {
+  uwsgi_rlock(h->lock);
+  bool ret = h->count > 0 && history_at(h, 0)->seq <= seq;
+  uwsgi_rwunlock(h->lock);
+  return ret;
+}
+
+static int history_writev(void *data, struct iovec *iov, int n) {
+  int fd = *(int *)data;
+  int start = 0;
+  while (start < n) {
+    ssize_t ret = writev(fd, &iov[start], n - start);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      uwsgi_error("writev() failed");
+      return -1;
+    }
+    while (start < n && (size_t)ret >= iov[start].iov_len) {
+      ret -= iov[start++].iov_len;
+    }
+    if (start < n) {
+      iov[start].iov_base = (char *)iov[start].iov_base + ret;
+      iov[start].iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+// Hand every frame captured between since and until (inclusive, in
+// uwsgi_micros() time) to write in batches. Each batch is copied out of the
+// arena without the lock held, so a slow consumer can never stall capture,
+// and only passed on once it's known not to have been overwritten while
+// copying; if capture laps the export, the export fails instead.
+int64_t capture_history_export_to(capture_history *h, uint64_t since,
+                                  uint64_t until, history_writer write,
+                                  void *data) {
+  history_entry batch[HISTORY_EXPORT_BATCH];
+  struct iovec iov[HISTORY_EXPORT_BATCH];
+  char *copy = NULL;
+  uint64_t copy_size = 0;
+  int64_t written = 0;
+
+  uwsgi_rlock(h->lock);
+  uint32_t first = history_search(h, since);
+  uint64_t after_seq =
+      (first < h->count) ? history_at(h, first)->seq - 1 : UINT64_MAX;
+  uwsgi_rwunlock(h->lock);
+
+  while (true) {
+    uint32_t n =
+        capture_history_collect(h, after_seq, batch, HISTORY_EXPORT_BATCH);
+    uint32_t count = 0;
+    uint64_t len = 0;
+    while (count < n && batch[count].timestamp <= until &&
+           (count == 0 || len + batch[count].length <= HISTORY_EXPORT_BUFFER)) {
+      len += batch[count].length;
+      count++;
+    }
+    if (count == 0) {
+      break;
+    }
+
+    if (len > copy_size) {
+      free(copy);
+      copy_size = (len > HISTORY_EXPORT_BUFFER) ? len : HISTORY_EXPORT_BUFFER;
+      copy = (char *)uwsgi_malloc(copy_size);
+    }
+    uint64_t pos = 0;
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(copy + pos, h->arena + batch[i].offset, batch[i].length);
+      iov[i].iov_base = copy + pos;
+      iov[i].iov_len = batch[i].length;
+      pos += batch[i].length;
+    }
+    if (!capture_history_contains(h, batch[0].seq)) {
+      uwsgi_log("capture history overwritten during export\n");
+      written = -1;
+      break;
+    }
+
+    if (write(data, iov, count) < 0) {
+      written = -1;
+      break;
+    }
+    written += len;
+    after_seq = batch[count - 1].seq;
+  }
+  free(copy);
+  return written;
+}
+
+// Export a time range to fd as a raw MJPEG stream.
+int64_t capture_history_export(capture_history *h, uint64_t since,
+                               uint64_t until, int fd) {
+  return capture_history_export_to(h, since, until, history_writev, &fd);
+}
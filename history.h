@@ -0,0 +1,53 @@
+#pragma once
+
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define HISTORY_DEFAULT_SIZE (64 * 1024 * 1024)
+#define HISTORY_MIN_FRAME_SIZE 4096
+#define HISTORY_EXPORT_BATCH 64
+// most bytes of frames an export copies out of the arena at a time
+#define HISTORY_EXPORT_BUFFER (4 * 1024 * 1024)
+
+typedef struct {
+  uint64_t seq;
+  uint64_t timestamp;
+  uint64_t offset;
+  uint32_t length;
+} history_entry;
+
+// Fixed-size ring of recent frames, living entirely in shared memory. Frames
+// are copied back to back into a single arena allocated up front, so appending
+// never calls malloc() and the arena can't fragment; the oldest frames are
+// evicted to make room.
+typedef struct {
+  struct uwsgi_lock_item *lock;
+  char *arena;
+  uint64_t arena_size;
+  uint64_t write_pos;
+  uint64_t max_age;
+  history_entry *entries;
+  uint32_t entries_size;
+  uint32_t head;
+  uint32_t count;
+  uint64_t dropped;
+} capture_history;
+
+// consumes a batch of exported frames, returning -1 to stop the export
+typedef int (*history_writer)(void *data, struct iovec *iov, int n);
+
+capture_history *capture_history_init(uint64_t size, uint32_t max_frames,
+                                      uint64_t max_age);
+void capture_history_free(capture_history *h);
+void capture_history_append(capture_history *h, char *frame, uint32_t len,
+                            uint64_t seq, uint64_t timestamp);
+uint32_t capture_history_collect(capture_history *h, uint64_t after_seq,
+                                history_entry *out, uint32_t max);
+bool capture_history_contains(capture_history *h, uint64_t seq);
+int64_t capture_history_export_to(capture_history *h, uint64_t since,
+                                  uint64_t until, history_writer write,
+                                  void *data);
+int64_t capture_history_export(capture_history *h, uint64_t since,
+                               uint64_t until, int fd);
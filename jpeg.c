@@ -0,0 +1,485 @@
+#include "jpeg.h"
+#include "decode.h"
+#include "pool.h"
+#include "uwsgiwrap.h"
+#include <inttypes.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// jpeglib.h needs stdio.h and stddef.h included first
+#include <jpeglib.h>
+
+#define JPEG_MAX_INPUTS 16
+
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+} jpeg_error;
+
+static void jpeg_error_exit(j_common_ptr cinfo) {
+  jpeg_error *err = (jpeg_error *)cinfo->err;
+  char msg[JMSG_LENGTH_MAX];
+  (*cinfo->err->format_message)(cinfo, msg);
+  uwsgi_log("libjpeg: %s\n", msg);
+  longjmp(err->jump, 1);
+}
+
+// corrupt-data warnings would flood the log at full frame rate
+static void jpeg_emit_message(j_common_ptr cinfo, int msg_level) {}
+
+static void jpeg_error_init(jpeg_error *err) {
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = jpeg_error_exit;
+  err->pub.emit_message = jpeg_emit_message;
+}
+
+// Blocks can only be moved around losslessly if the image is a whole number
+// of MCUs; otherwise the edge MCUs are padded and won't line up.
+static bool jpeg_mcu_aligned(struct jpeg_decompress_struct *in) {
+  return in->image_width % (in->max_h_samp_factor * DCTSIZE) == 0 &&
+         in->image_height % (in->max_v_samp_factor * DCTSIZE) == 0;
+}
+
+static bool jpeg_compatible(struct jpeg_decompress_struct *a,
+                            struct jpeg_decompress_struct *b) {
+  if (a->image_width != b->image_width ||
+      a->image_height != b->image_height ||
+      a->num_components != b->num_components) {
+    return false;
+  }
+  for (int c = 0; c < a->num_components; c++) {
+    if (a->comp_info[c].h_samp_factor != b->comp_info[c].h_samp_factor ||
+        a->comp_info[c].v_samp_factor != b->comp_info[c].v_samp_factor) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Copy one row of blocks, rescaling the coefficients if the source was
+// quantized differently to the output.
+static void jpeg_copy_blocks(JBLOCKROW dst, JBLOCKROW src, JDIMENSION count,
+                             JQUANT_TBL *dst_q, JQUANT_TBL *src_q) {
+  if (dst_q == src_q || src_q == NULL || dst_q == NULL ||
+      !memcmp(dst_q->quantval, src_q->quantval, sizeof(dst_q->quantval))) {
+    memcpy(dst, src, count * sizeof(JBLOCK));
+    return;
+  }
+
+  for (JDIMENSION b = 0; b < count; b++) {
+    for (int k = 0; k < DCTSIZE2; k++) {
+      int v = src[b][k] * src_q->quantval[k];
+      int q = dst_q->quantval[k];
+      dst[b][k] = (JCOEF)((v >= 0) ? (v + q / 2) / q : -((-v + q / 2) / q));
+    }
+  }
+}
+
+// Stitch frames into a grid with the given number of columns without decoding
+// them, by copying their DCT blocks into one larger image. Every frame must
+// have the same dimensions and subsampling and be a whole number of MCUs, or
+// JPEG_INCOMPATIBLE is returned; frames without data leave their cell grey.
+int jpeg_mosaic(capture_frame *inputs, uint8_t count, uint8_t columns,
+                char *out, uint32_t out_size, uint32_t *out_len) {
+  struct jpeg_decompress_struct in[JPEG_MAX_INPUTS];
+  jvirt_barray_ptr *in_coef[JPEG_MAX_INPUTS];
+  struct jpeg_compress_struct dst;
+  jpeg_error err;
+  volatile int opened = 0;
+  volatile bool dst_created = false;
+  volatile int ret = -1;
+  volatile int first = -1;
+
+  if (count > JPEG_MAX_INPUTS || columns == 0) {
+    return -1;
+  }
+
+  jpeg_error_init(&err);
+  if (setjmp(err.jump)) {
+    goto end;
+  }
+
+  for (int i = 0; i < count; i++) {
+    in[i].err = &err.pub;
+    jpeg_create_decompress(&in[i]);
+    opened = i + 1;
+    if (inputs[i].data == NULL) {
+      continue;
+    }
+
+    jpeg_mem_src(&in[i], (unsigned char *)inputs[i].data, inputs[i].length);
+    jpeg_read_header(&in[i], TRUE);
+    if (first < 0) {
+      if (!jpeg_mcu_aligned(&in[i])) {
+        ret = JPEG_INCOMPATIBLE;
+        goto end;
+      }
+      first = i;
+    } else if (!jpeg_compatible(&in[first], &in[i])) {
+      ret = JPEG_INCOMPATIBLE;
+      goto end;
+    }
+    in_coef[i] = jpeg_read_coefficients(&in[i]);
+  }
+  if (first < 0) {
+    goto end;
+  }
+
+  uint8_t rows = (count + columns - 1) / columns;
+  dst.err = &err.pub;
+  jpeg_create_compress(&dst);
+  dst_created = true;
+  jpeg_copy_critical_parameters(&in[first], &dst);
+  dst.image_width = in[first].image_width * columns;
+  dst.image_height = in[first].image_height * rows;
+  dst.optimize_coding = FALSE;
+
+  jvirt_barray_ptr out_coef[MAX_COMPONENTS];
+  for (int c = 0; c < dst.num_components; c++) {
+    jpeg_component_info *comp = &in[first].comp_info[c];
+    out_coef[c] = (*dst.mem->request_virt_barray)(
+        (j_common_ptr)&dst, JPOOL_IMAGE, TRUE, comp->width_in_blocks * columns,
+        comp->height_in_blocks * rows, comp->v_samp_factor);
+  }
+  (*dst.mem->realize_virt_arrays)((j_common_ptr)&dst);
+
+  for (int i = 0; i < count; i++) {
+    if (inputs[i].data == NULL) {
+      continue;
+    }
+    for (int c = 0; c < dst.num_components; c++) {
+      jpeg_component_info *comp = &in[i].comp_info[c];
+      JDIMENSION x = (i % columns) * comp->width_in_blocks;
+      JDIMENSION y = (i / columns) * comp->height_in_blocks;
+      for (JDIMENSION row = 0; row < comp->height_in_blocks; row++) {
+        JBLOCKARRAY src = (*in[i].mem->access_virt_barray)(
+            (j_common_ptr)&in[i], in_coef[i][c], row, 1, FALSE);
+        JBLOCKARRAY dst_row = (*dst.mem->access_virt_barray)(
+            (j_common_ptr)&dst, out_coef[c], y + row, 1, TRUE);
+        jpeg_copy_blocks(dst_row[0] + x, src[0], comp->width_in_blocks,
+                         dst.quant_tbl_ptrs[dst.comp_info[c].quant_tbl_no],
+                         comp->quant_table);
+      }
+    }
+  }
+
+  // write straight into the output buffer; libjpeg swaps in a bigger one of
+  // its own if the result doesn't fit
+  unsigned char *buf = (unsigned char *)out;
+  unsigned long size = out_size;
+  jpeg_mem_dest(&dst, &buf, &size);
+  jpeg_write_coefficients(&dst, out_coef);
+  jpeg_finish_compress(&dst);
+  if (buf != (unsigned char *)out) {
+    free(buf);
+    uwsgi_log("mosaic doesn't fit in its %" PRIu32 " byte buffer\n", out_size);
+    goto end;
+  }
+  *out_len = size;
+  ret = 0;
+
+end:
+  if (dst_created) {
+    jpeg_destroy_compress(&dst);
+  }
+  for (int i = 0; i < opened; i++) {
+    jpeg_destroy_decompress(&in[i]);
+  }
+  return ret;
+}
+
+// Compose frames into a grid by decoding and re-encoding them, for frames
+// jpeg_mosaic() can't stitch together losslessly. Cells are as big as the
+// largest frame, smaller frames sit in their top left corner, and anything
+// not covered by a frame is grey. Only one row of the grid is decoded at a
+// time, a scanline from each of its frames per output scanline.
+int jpeg_mosaic_reencode(capture_frame *inputs, uint8_t count, uint8_t columns,
+                         uint8_t quality, char *out, uint32_t out_size,
+                         uint32_t *out_len) {
+  struct jpeg_decompress_struct in[JPEG_MAX_INPUTS];
+  struct jpeg_compress_struct dst;
+  jpeg_error err;
+  volatile int opened = 0;
+  volatile bool dst_created = false;
+  volatile int ret = -1;
+  JDIMENSION cell_width = 0, cell_height = 0;
+
+  if (count > JPEG_MAX_INPUTS || columns == 0) {
+    return -1;
+  }
+
+  jpeg_error_init(&err);
+  if (setjmp(err.jump)) {
+    goto end;
+  }
+
+  for (int i = 0; i < count; i++) {
+    in[i].err = &err.pub;
+    jpeg_create_decompress(&in[i]);
+    opened = i + 1;
+    if (inputs[i].data == NULL) {
+      continue;
+    }
+
+    jpeg_mem_src(&in[i], (unsigned char *)inputs[i].data, inputs[i].length);
+    jpeg_read_header(&in[i], TRUE);
+    in[i].out_color_space = JCS_RGB;
+    in[i].dct_method = JDCT_IFAST;
+    if (in[i].image_width > cell_width) {
+      cell_width = in[i].image_width;
+    }
+    if (in[i].image_height > cell_height) {
+      cell_height = in[i].image_height;
+    }
+  }
+  if (cell_width == 0) {
+    goto end;
+  }
+
+  uint8_t rows = (count + columns - 1) / columns;
+  dst.err = &err.pub;
+  jpeg_create_compress(&dst);
+  dst_created = true;
+  dst.image_width = cell_width * columns;
+  dst.image_height = cell_height * rows;
+  dst.input_components = 3;
+  dst.in_color_space = JCS_RGB;
+  jpeg_set_defaults(&dst);
+  jpeg_set_quality(&dst, quality, TRUE);
+  dst.dct_method = JDCT_IFAST;
+
+  // as in jpeg_mosaic(), libjpeg swaps in a buffer of its own on overflow
+  unsigned char *buf = (unsigned char *)out;
+  unsigned long size = out_size;
+  jpeg_mem_dest(&dst, &buf, &size);
+  jpeg_start_compress(&dst, TRUE);
+
+  JSAMPARRAY line = (*dst.mem->alloc_sarray)((j_common_ptr)&dst, JPOOL_IMAGE,
+                                             dst.image_width * 3, 1);
+  for (int row = 0; row < rows; row++) {
+    int start = row * columns;
+    int end = (start + columns < count) ? start + columns : count;
+    for (int i = start; i < end; i++) {
+      if (inputs[i].data != NULL) {
+        jpeg_start_decompress(&in[i]);
+      }
+    }
+
+    for (JDIMENSION y = 0; y < cell_height; y++) {
+      memset(line[0], 128, dst.image_width * 3);
+      for (int i = start; i < end; i++) {
+        if (inputs[i].data == NULL ||
+            in[i].output_scanline >= in[i].output_height) {
+          continue;
+        }
+        JSAMPROW cell = line[0] + (i - start) * cell_width * 3;
+        jpeg_read_scanlines(&in[i], &cell, 1);
+      }
+      jpeg_write_scanlines(&dst, line, 1);
+    }
+
+    for (int i = start; i < end; i++) {
+      if (inputs[i].data != NULL) {
+        jpeg_finish_decompress(&in[i]);
+      }
+    }
+  }
+
+  jpeg_finish_compress(&dst);
+  if (buf != (unsigned char *)out) {
+    free(buf);
+    uwsgi_log("mosaic doesn't fit in its %" PRIu32 " byte buffer\n", out_size);
+    goto end;
+  }
+  *out_len = size;
+  ret = 0;
+
+end:
+  if (dst_created) {
+    jpeg_destroy_compress(&dst);
+  }
+  for (int i = 0; i < opened; i++) {
+    jpeg_destroy_decompress(&in[i]);
+  }
+  return ret;
+}
+
+// Decode a frame into planar gray or I420 pixels, shrunk by 1/scale in the DCT
+// domain if asked (which is much cheaper than decoding at full size).
+int jpeg_decode_planes(char *data, uint32_t len, uint8_t format, uint8_t scale,
+                       char *out, uint64_t out_size, uint32_t *width,
+                       uint32_t *height) {
+  struct jpeg_decompress_struct in;
+  jpeg_error err;
+  volatile int ret = -1;
+
+  jpeg_error_init(&err);
+  in.err = &err.pub;
+  jpeg_create_decompress(&in);
+  if (setjmp(err.jump)) {
+    goto end;
+  }
+
+  jpeg_mem_src(&in, (unsigned char *)data, len);
+  jpeg_read_header(&in, TRUE);
+  in.scale_num = 1;
+  in.scale_denom = scale;
+  in.dct_method = JDCT_IFAST;
+  in.do_fancy_upsampling = FALSE;
+  in.out_color_space = (format == DECODE_GRAY) ? JCS_GRAYSCALE : JCS_YCbCr;
+  jpeg_start_decompress(&in);
+
+  JDIMENSION w = in.output_width, h = in.output_height;
+  JDIMENSION cw = (w + 1) / 2, ch = (h + 1) / 2;
+  uint64_t luma = (uint64_t)w * h;
+  if (luma + ((format == DECODE_GRAY) ? 0 : 2 * (uint64_t)cw * ch) >
+      out_size) {
+    jpeg_abort_decompress(&in);
+    goto end;
+  }
+
+  if (format == DECODE_GRAY) {
+    while (in.output_scanline < h) {
+      JSAMPROW row = (JSAMPROW)out + (uint64_t)in.output_scanline * w;
+      jpeg_read_scanlines(&in, &row, 1);
+    }
+  } else {
+    // read two interleaved rows at a time and average each 2x2 block of
+    // chroma down into the U and V planes
+    JSAMPARRAY rows = (*in.mem->alloc_sarray)((j_common_ptr)&in, JPOOL_IMAGE,
+                                              w * 3, 2);
+    unsigned char *y_plane = (unsigned char *)out;
+    unsigned char *u_plane = y_plane + luma;
+    unsigned char *v_plane = u_plane + (uint64_t)cw * ch;
+    while (in.output_scanline < h) {
+      JDIMENSION y = in.output_scanline;
+      JDIMENSION n = jpeg_read_scanlines(&in, rows, 2);
+      if (n == 1 && in.output_scanline < h) {
+        n += jpeg_read_scanlines(&in, rows + 1, 1);
+      }
+      JSAMPROW second = rows[n > 1 ? 1 : 0];
+      for (JDIMENSION x = 0; x < w; x++) {
+        y_plane[(uint64_t)y * w + x] = rows[0][x * 3];
+        if (n > 1) {
+          y_plane[(uint64_t)(y + 1) * w + x] = rows[1][x * 3];
+        }
+      }
+      for (JDIMENSION x = 0; x < cw; x++) {
+        JDIMENSION x1 = (2 * x + 1 < w) ? 2 * x + 1 : 2 * x;
+        for (int c = 1; c <= 2; c++) {
+          unsigned sum = rows[0][2 * x * 3 + c] + rows[0][x1 * 3 + c] +
+                         second[2 * x * 3 + c] + second[x1 * 3 + c];
+          unsigned char *plane = (c == 1) ? u_plane : v_plane;
+          plane[(uint64_t)(y / 2) * cw + x] = (sum + 2) / 4;
+        }
+      }
+    }
+  }
+
+  jpeg_finish_decompress(&in);
+  *width = w;
+  *height = h;
+  ret = 0;
+
+end:
+  jpeg_destroy_decompress(&in);
+  return ret;
+}
+
+// Cut a region out of a frame without decoding it, by copying only the DCT
+// blocks it covers. The region is widened to whole MCUs (and clipped to the
+// frame), since that's as fine as blocks can be cut losslessly.
+int jpeg_crop(capture_frame *input, uint32_t x, uint32_t y, uint32_t width,
+              uint32_t height, char *out, uint32_t out_size,
+              uint32_t *out_len) {
+  struct jpeg_decompress_struct in;
+  struct jpeg_compress_struct dst;
+  jpeg_error err;
+  volatile bool dst_created = false;
+  volatile int ret = -1;
+
+  jpeg_error_init(&err);
+  in.err = &err.pub;
+  jpeg_create_decompress(&in);
+  if (setjmp(err.jump)) {
+    goto end;
+  }
+
+  jpeg_mem_src(&in, (unsigned char *)input->data, input->length);
+  jpeg_read_header(&in, TRUE);
+  jvirt_barray_ptr *in_coef = jpeg_read_coefficients(&in);
+
+  uint32_t mcu_w = in.max_h_samp_factor * DCTSIZE;
+  uint32_t mcu_h = in.max_v_samp_factor * DCTSIZE;
+  uint32_t x0 = x / mcu_w * mcu_w, y0 = y / mcu_h * mcu_h;
+  if (x0 >= in.image_width || y0 >= in.image_height || width == 0 ||
+      height == 0) {
+    goto end;
+  }
+  uint32_t x1 = (x + width + mcu_w - 1) / mcu_w * mcu_w;
+  uint32_t y1 = (y + height + mcu_h - 1) / mcu_h * mcu_h;
+  if (x1 > in.image_width) {
+    x1 = in.image_width;
+  }
+  if (y1 > in.image_height) {
+    y1 = in.image_height;
+  }
+
+  dst.err = &err.pub;
+  jpeg_create_compress(&dst);
+  dst_created = true;
+  jpeg_copy_critical_parameters(&in, &dst);
+  dst.image_width = x1 - x0;
+  dst.image_height = y1 - y0;
+  dst.optimize_coding = FALSE;
+
+  // a partial MCU at the right or bottom edge of the frame still has all of
+  // its blocks, so whole MCUs are always there to copy
+  jvirt_barray_ptr out_coef[MAX_COMPONENTS];
+  JDIMENSION widths[MAX_COMPONENTS], heights[MAX_COMPONENTS];
+  for (int c = 0; c < dst.num_components; c++) {
+    jpeg_component_info *comp = &in.comp_info[c];
+    widths[c] = (dst.image_width + mcu_w - 1) / mcu_w * comp->h_samp_factor;
+    heights[c] = (dst.image_height + mcu_h - 1) / mcu_h * comp->v_samp_factor;
+    out_coef[c] = (*dst.mem->request_virt_barray)(
+        (j_common_ptr)&dst, JPOOL_IMAGE, TRUE, widths[c], heights[c],
+        comp->v_samp_factor);
+  }
+  (*dst.mem->realize_virt_arrays)((j_common_ptr)&dst);
+
+  for (int c = 0; c < dst.num_components; c++) {
+    jpeg_component_info *comp = &in.comp_info[c];
+    JDIMENSION bx = x0 / mcu_w * comp->h_samp_factor;
+    JDIMENSION by = y0 / mcu_h * comp->v_samp_factor;
+    for (JDIMENSION row = 0; row < heights[c]; row++) {
+      JBLOCKARRAY src = (*in.mem->access_virt_barray)(
+          (j_common_ptr)&in, in_coef[c], by + row, 1, FALSE);
+      JBLOCKARRAY dst_row = (*dst.mem->access_virt_barray)(
+          (j_common_ptr)&dst, out_coef[c], row, 1, TRUE);
+      memcpy(dst_row[0], src[0] + bx, widths[c] * sizeof(JBLOCK));
+    }
+  }
+
+  unsigned char *buf = (unsigned char *)out;
+  unsigned long size = out_size;
+  jpeg_mem_dest(&dst, &buf, &size);
+  jpeg_write_coefficients(&dst, out_coef);
+  jpeg_finish_compress(&dst);
+  if (buf != (unsigned char *)out) {
+    free(buf);
+    uwsgi_log("crop doesn't fit in its %" PRIu32 " byte buffer\n", out_size);
+    goto end;
+  }
+  *out_len = size;
+  ret = 0;
+
+end:
+  if (dst_created) {
+    jpeg_destroy_compress(&dst);
+  }
+  jpeg_destroy_decompress(&in);
+  return ret;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "pool.h"
+#include <stdint.h>
+
+// returned by jpeg_mosaic() for frames that can't be stitched losslessly
+#define JPEG_INCOMPATIBLE -2
+
+int jpeg_mosaic(capture_frame *inputs, uint8_t count, uint8_t columns,
+                char *out, uint32_t out_size, uint32_t *out_len);
+int jpeg_mosaic_reencode(capture_frame *inputs, uint8_t count, uint8_t columns,
+                         uint8_t quality, char *out, uint32_t out_size,
+                         uint32_t *out_len);
+int jpeg_crop(capture_frame *input, uint32_t x, uint32_t y, uint32_t width,
+              uint32_t height, char *out, uint32_t out_size,
+              uint32_t *out_len);
+int jpeg_decode_planes(char *data, uint32_t len, uint8_t format, uint8_t scale,
+                       char *out, uint64_t out_size, uint32_t *width,
+                       uint32_t *height);
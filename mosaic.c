@@ -0,0 +1,141 @@
+#include "mosaic.h"
+#include "capture.h"
+#include "jpeg.h"
+#include "pool.h"
+#include "uwsgiwrap.h"
+#include "v4l.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// A mosaic context's path is "<columns>:<id>,<id>,...", naming the contexts to
+// lay out in a grid by their position in the list of contexts.
+int capture_ctx_mosaic_init(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  capture_mosaic *m =
+      (capture_mosaic *)uwsgi_calloc_shared(sizeof(capture_mosaic));
+  char *spec = config->path;
+  char *ids = strchr(spec, ':');
+  if (ids == NULL) {
+    uwsgi_log("invalid mosaic %s, expected <columns>:<id>,<id>,...\n", spec);
+    return -1;
+  }
+  m->columns = atoi(spec);
+
+  uint64_t frame_size = 0;
+  for (char *id = ids + 1; *id != 0 && m->count < MOSAIC_MAX_INPUTS;) {
+    capture_context *input = capture_ctx_get(atoi(id));
+    if (input == NULL || input->pool == NULL) {
+      uwsgi_log("mosaic %s refers to unknown context %d\n", spec, atoi(id));
+      return -1;
+    }
+    m->inputs[m->count++] = atoi(id);
+    frame_size += input->pool->slots[0].length;
+
+    id = strchr(id, ',');
+    if (id == NULL) {
+      break;
+    }
+    id++;
+  }
+
+  if (m->columns == 0 || m->count == 0) {
+    uwsgi_log("invalid mosaic %s, expected <columns>:<id>,<id>,...\n", spec);
+    return -1;
+  }
+
+  config->buffers = capture_pool_buffers(config->buffers);
+
+  // the grid can't be much bigger than all of its cells put together
+  ctx->pool = capture_pool_init(config->buffers);
+  char *area = (char *)uwsgi_malloc_shared(frame_size * config->buffers);
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    ctx->pool->slots[i].data = area + i * frame_size;
+    ctx->pool->slots[i].length = frame_size;
+  }
+
+  ctx->sa = uwsgi_sharedarea_init_ptr(area, frame_size);
+  ctx->sa->fd = -1;
+  ctx->sa->honour_used = 1;
+  ctx->pool->lock = ctx->sa->lock;
+  ctx->mosaic = m;
+  capture_ctx_init_outputs(ctx);
+
+  uwsgi_log("composing mosaic %s into sharedarea %d\n", spec, ctx->sa->id);
+  return 0;
+}
+
+// Rebuild the mosaic if any of its inputs has a new frame and anyone has asked
+// for the mosaic lately.
+int capture_ctx_mosaic_process(capture_context *ctx,
+                               capture_context *contexts, uint8_t length) {
+  capture_mosaic *m = ctx->mosaic;
+  // pinning the inputs' frames would keep them streaming for nobody
+  if (!capture_ctx_wanted(ctx)) {
+    return 0;
+  }
+  bool updated = false;
+  for (uint8_t i = 0; i < m->count; i++) {
+    if (m->inputs[i] >= length || contexts[m->inputs[i]].sa == NULL) {
+      continue;
+    }
+    // whoever's watching the mosaic is watching its inputs too
+    capture_demand_touch(contexts[m->inputs[i]].pool->demand);
+    uint64_t seq = contexts[m->inputs[i]].sa->updates;
+    if (seq != m->seqs[i]) {
+      m->seqs[i] = seq;
+      updated = true;
+    }
+  }
+  if (!updated) {
+    return 0;
+  }
+
+  int index = -1;
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    if (capture_pool_reclaimable(ctx->pool, i)) {
+      index = i;
+      break;
+    }
+  }
+  if (index < 0) {
+    // every buffer is pinned
+    m->dropped++;
+    return 0;
+  }
+
+  capture_frame frames[MOSAIC_MAX_INPUTS];
+  for (uint8_t i = 0; i < m->count; i++) {
+    if (m->inputs[i] >= length || contexts[m->inputs[i]].sa == NULL ||
+        capture_frame_pin(contexts[m->inputs[i]].pool, &frames[i]) < 0) {
+      memset(&frames[i], 0, sizeof(frames[i]));
+    }
+  }
+
+  pool_slot *slot = &ctx->pool->slots[index];
+  uint32_t used;
+  int ret = jpeg_mosaic(frames, m->count, m->columns, slot->data, slot->length,
+                        &used);
+  if (ret == JPEG_INCOMPATIBLE) {
+    if (m->reencoded == 0) {
+      uwsgi_log("inputs of mosaic %s can't be stitched losslessly, "
+                "re-encoding it instead\n",
+                ctx->config->path);
+    }
+    m->reencoded++;
+    ret = jpeg_mosaic_reencode(frames, m->count, m->columns,
+                               ctx->config->quality, slot->data, slot->length,
+                               &used);
+  }
+  for (uint8_t i = 0; i < m->count; i++) {
+    capture_frame_unpin(&frames[i]);
+  }
+
+  if (ret < 0) {
+    m->dropped++;
+    return 0;
+  }
+  capture_ctx_publish(ctx, index, used, 0, uwsgi_micros());
+  return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stdint.h>
+
+#define MOSAIC_MAX_INPUTS 16
+
+typedef struct {
+  uint8_t columns;
+  uint8_t count;
+  uint8_t inputs[MOSAIC_MAX_INPUTS];
+  uint64_t seqs[MOSAIC_MAX_INPUTS];
+  // frames composed by decoding and re-encoding the inputs
+  uint64_t reencoded;
+  uint64_t dropped;
+} capture_mosaic;
@@ -0,0 +1,77 @@
+#include "notify.h"
+#include "uwsgiwrap.h"
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+static notify_waiter *waiters = NULL;
+static int waiters_count = 0;
+
+// needs to run in the master, once the number of workers and cores is known
+void capture_notify_init() {
+  if (waiters != NULL) {
+    return;
+  }
+
+  int count = uwsgi.numproc * uwsgi.cores;
+  if (count > NOTIFY_MAX_WAITERS) {
+    uwsgi_log("only %d of %d cores will wait for frames without polling\n",
+              NOTIFY_MAX_WAITERS, count);
+    count = NOTIFY_MAX_WAITERS;
+  }
+  waiters =
+      (notify_waiter *)uwsgi_calloc_shared(sizeof(notify_waiter) * count);
+  for (; waiters_count < count; waiters_count++) {
+    waiters[waiters_count].fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (waiters[waiters_count].fd < 0) {
+      uwsgi_error("eventfd() failed");
+      break;
+    }
+  }
+}
+
+// the calling core's waiter, or NULL if it has to poll
+notify_waiter *capture_notify_waiter(struct wsgi_request *wsgi_req) {
+  if (uwsgi.mywid <= 0) {
+    return NULL;
+  }
+  int i = (uwsgi.mywid - 1) * uwsgi.cores + wsgi_req->async_id;
+  return (i < waiters_count) ? &waiters[i] : NULL;
+}
+
+// Sleep (without blocking other async cores) until sa might have been updated
+// past seq or timeout microseconds pass, returning false if waiting failed.
+// Wakeups can be spurious, so callers check the update counter again.
+bool capture_notify_wait(notify_waiter *w, struct uwsgi_sharedarea *sa,
+                         uint64_t seq, uint64_t timeout) {
+  __atomic_store_n(&w->waiting, sa->id + 1, __ATOMIC_SEQ_CST);
+  int ret = 1;
+  // anything published before we said we were waiting won't wake us
+  if (__atomic_load_n(&sa->updates, __ATOMIC_SEQ_CST) <= seq) {
+    int seconds = (timeout + 999999) / 1000000;
+    ret = uwsgi.wait_read_hook(w->fd, (seconds > 0) ? seconds : 1);
+  }
+  __atomic_store_n(&w->waiting, 0, __ATOMIC_RELEASE);
+
+  uint64_t wakeups;
+  if (read(w->fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+    uwsgi_error("read() from frame notification eventfd failed");
+  }
+  return ret >= 0;
+}
+
+// wake every core waiting on sa, which has just been updated
+void capture_notify_publish(struct uwsgi_sharedarea *sa) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (int i = 0; i < waiters_count; i++) {
+    if (__atomic_load_n(&waiters[i].waiting, __ATOMIC_RELAXED) != sa->id + 1) {
+      continue;
+    }
+    uint64_t one = 1;
+    if (write(waiters[i].fd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+      uwsgi_error("write() to frame notification eventfd failed");
+    }
+  }
+}
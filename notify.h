@@ -0,0 +1,24 @@
+#pragma once
+
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+// eventfds are plentiful but not free; cores past this many poll instead
+#define NOTIFY_MAX_WAITERS 1024
+
+// Every worker core gets an eventfd of its own, created before fork, and
+// records which sharedarea it's waiting on. Publishing a frame only writes to
+// the eventfds of cores waiting on that sharedarea, so nobody wakes up unless
+// there's something for them.
+typedef struct {
+  int fd;
+  // id of the sharedarea waited on plus one, 0 when not waiting
+  int waiting;
+} notify_waiter;
+
+void capture_notify_init();
+notify_waiter *capture_notify_waiter(struct wsgi_request *wsgi_req);
+bool capture_notify_wait(notify_waiter *w, struct uwsgi_sharedarea *sa,
+                         uint64_t seq, uint64_t timeout);
+void capture_notify_publish(struct uwsgi_sharedarea *sa);
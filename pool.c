@@ -0,0 +1,108 @@
+#include "pool.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <unistd.h>
+
+// the number of buffers to use for a requested --buffers (0 for the default)
+uint8_t capture_pool_buffers(uint8_t requested) {
+  if (requested == 0) {
+    return POOL_DEFAULT_BUFFERS;
+  } else if (requested < POOL_MIN_BUFFERS) {
+    return POOL_MIN_BUFFERS;
+  } else if (requested > POOL_MAX_BUFFERS) {
+    return POOL_MAX_BUFFERS;
+  }
+  return requested;
+}
+
+capture_pool *capture_pool_init(uint8_t count) {
+  capture_pool *pool =
+      (capture_pool *)uwsgi_calloc_shared(sizeof(capture_pool));
+  pool->fd = -1;
+  pool->count = count;
+  pool->latest = -1;
+  return pool;
+}
+
+// The buffers themselves stay mapped for the sharedarea they back, since uwsgi
+// has no way to unregister one.
+void capture_pool_free(capture_pool *pool) {
+  if (pool->demand != NULL) {
+    capture_demand_free(pool->demand);
+  }
+  if (pool->fd >= 0) {
+    close(pool->fd);
+  }
+  capture_free_shared(pool, sizeof(*pool));
+}
+
+uint8_t capture_pool_queued(capture_pool *pool) {
+  uint8_t queued = 0;
+  for (uint8_t i = 0; i < pool->count; i++) {
+    if (pool->slots[i].queued) {
+      queued++;
+    }
+  }
+  return queued;
+}
+
+// Only the latest frame can be pinned, and the latest frame only changes with
+// the write lock held, so once a buffer has been replaced its refcount can
+// only go down.
+bool capture_pool_reclaimable(capture_pool *pool, uint8_t index) {
+  pool_slot *slot = &pool->slots[index];
+  return !slot->queued && (int)index != pool->latest &&
+         __atomic_load_n(&slot->refs, __ATOMIC_ACQUIRE) == 0;
+}
+
+// Take a reference to the latest frame. Capture carries on in the other
+// buffers until it's released with capture_frame_unpin(), so the frame can be
+// read without copying it or holding any lock.
+int capture_frame_pin(capture_pool *pool, capture_frame *frame) {
+  if (pool->demand != NULL) {
+    capture_demand_touch(pool->demand);
+  }
+
+  uwsgi_rlock(pool->lock);
+  if (pool->latest < 0) {
+    uwsgi_rwunlock(pool->lock);
+    return -1;
+  }
+
+  pool_slot *slot = &pool->slots[pool->latest];
+  __atomic_add_fetch(&slot->refs, 1, __ATOMIC_ACQUIRE);
+  frame->pool = pool;
+  frame->index = pool->latest;
+  frame->data = slot->data;
+  frame->fd = pool->fd;
+  frame->offset = slot->offset;
+  frame->length = slot->used;
+  frame->seq = slot->seq;
+  frame->timestamp = slot->timestamp;
+  uwsgi_rwunlock(pool->lock);
+  return 0;
+}
+
+void capture_frame_unpin(capture_frame *frame) {
+  if (frame->pool == NULL) {
+    return;
+  }
+  __atomic_sub_fetch(&frame->pool->slots[frame->index].refs, 1,
+                     __ATOMIC_RELEASE);
+  frame->pool = NULL;
+}
+
+// Send a pinned frame as the response body, with sendfile() if it lives in a
+// memfd. Offloaded transfers finish after the caller has unpinned the frame,
+// by which point the driver may be writing into its buffer again, so those
+// are written from the mapping instead.
+int capture_frame_send(struct wsgi_request *wsgi_req, capture_frame *frame) {
+  if (frame->fd >= 0 &&
+      !(uwsgi.offload_threads > 0 && wsgi_req->socket->can_offload)) {
+    return uwsgi_response_sendfile_do_can_close(
+        wsgi_req, frame->fd, frame->offset, frame->length, 0);
+  }
+  return uwsgi_response_write_body_do(wsgi_req, frame->data, frame->length);
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "demand.h"
+#include "uwsgiwrap.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+#define POOL_DEFAULT_BUFFERS 4
+// the latest frame is never requeued, so one more is needed to keep capturing
+#define POOL_MIN_BUFFERS 2
+#define POOL_MAX_BUFFERS 16
+#define POOL_STARVED_POLL 10000
+
+typedef struct {
+  char *data;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t used;
+  uint64_t seq;
+  uint64_t timestamp;
+  int refs;
+  bool queued;
+} pool_slot;
+
+// The driver's capture buffers, shared between the capture mule and every
+// reader. A buffer is only handed back to the driver once it's neither the
+// latest frame nor pinned by anyone.
+// When the buffers are carved out of a memfd, fd is that memfd and each slot's
+// offset is its position in it, so frames can be served with sendfile().
+typedef struct {
+  struct uwsgi_lock_item *lock;
+  capture_demand *demand;
+  int fd;
+  uint32_t memory;
+  uint8_t count;
+  int latest;
+  pool_slot slots[POOL_MAX_BUFFERS];
+} capture_pool;
+
+typedef struct {
+  capture_pool *pool;
+  uint8_t index;
+  char *data;
+  int fd;
+  uint64_t offset;
+  uint32_t length;
+  uint64_t seq;
+  uint64_t timestamp;
+} capture_frame;
+
+uint8_t capture_pool_buffers(uint8_t requested);
+capture_pool *capture_pool_init(uint8_t count);
+void capture_pool_free(capture_pool *pool);
+uint8_t capture_pool_queued(capture_pool *pool);
+bool capture_pool_reclaimable(capture_pool *pool, uint8_t index);
+
+int capture_frame_pin(capture_pool *pool, capture_frame *frame);
+void capture_frame_unpin(capture_frame *frame);
+int capture_frame_send(struct wsgi_request *wsgi_req, capture_frame *frame);
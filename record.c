@@ -0,0 +1,298 @@
+#include "record.h"
+#include "history.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+capture_recorder *capture_recorder_init(char *dir, uint32_t segment_seconds,
+                                        int id) {
+  if (segment_seconds == 0) {
+    segment_seconds = RECORD_DEFAULT_SEGMENT;
+  }
+
+  capture_recorder *r = (capture_recorder *)uwsgi_calloc(sizeof(*r));
+  r->dir = dir;
+  r->segment_length = segment_seconds * 1000000ULL;
+  r->id = id;
+  r->stats = (record_stats *)uwsgi_calloc_shared(sizeof(record_stats));
+  r->fd = -1;
+  r->index_fd = -1;
+  return r;
+}
+
+static void recorder_close(capture_recorder *r) {
+  if (r->fd >= 0) {
+    close(r->fd);
+    r->fd = -1;
+  }
+  if (r->index_fd >= 0) {
+    close(r->index_fd);
+    r->index_fd = -1;
+  }
+}
+
+void capture_recorder_free(capture_recorder *r) {
+  recorder_close(r);
+  capture_free_shared(r->stats, sizeof(record_stats));
+  free(r);
+}
+
+static int recorder_rotate(capture_recorder *r, uint64_t timestamp) {
+  recorder_close(r);
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%d-%" PRIu64 ".mjpeg", r->dir, r->id,
+           timestamp);
+  r->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (r->fd < 0) {
+    uwsgi_error("could not open() recording segment");
+    return -1;
+  }
+
+  snprintf(path, sizeof(path), "%s/%d-%" PRIu64 ".idx", r->dir, r->id,
+           timestamp);
+  r->index_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (r->index_fd < 0) {
+    uwsgi_error("could not open() recording index");
+    recorder_close(r);
+    return -1;
+  }
+
+  r->segment_start = timestamp;
+  r->offset = 0;
+  r->index_offset = 0;
+  r->stats->segments++;
+  return 0;
+}
+
+static int pwritev_all(int fd, struct iovec *iov, int n, uint64_t offset) {
+  int start = 0;
+  while (start < n) {
+    ssize_t ret = pwritev(fd, &iov[start], n - start, offset);
+    if (ret < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    offset += ret;
+    while (start < n && (size_t)ret >= iov[start].iov_len) {
+      ret -= iov[start++].iov_len;
+    }
+    if (start < n) {
+      iov[start].iov_base = (char *)iov[start].iov_base + ret;
+      iov[start].iov_len -= ret;
+    }
+  }
+  return 0;
+}
+
+// write frames [0, n) of batch, which all belong to the current segment
+static int recorder_write(capture_recorder *r, capture_history *h,
+                          history_entry *batch, uint32_t n) {
+  struct iovec iov[RECORD_BATCH];
+  record_index_entry index[RECORD_BATCH];
+  uint64_t offset = r->offset;
+  for (uint32_t i = 0; i < n; i++) {
+    iov[i].iov_base = h->arena + batch[i].offset;
+    iov[i].iov_len = batch[i].length;
+    index[i].seq = batch[i].seq;
+    index[i].timestamp = batch[i].timestamp;
+    index[i].offset = offset;
+    index[i].length = batch[i].length;
+    index[i].reserved = 0;
+    offset += batch[i].length;
+  }
+
+  // the history lock isn't held while writing, so a slow disk can never stall
+  // capture; instead, if capture lapped us mid-write, throw the batch away
+  if (pwritev_all(r->fd, iov, n, r->offset) < 0) {
+    uwsgi_error("pwritev() failed");
+    r->stats->dropped += n;
+    return -1;
+  }
+
+  if (!capture_history_contains(h, batch[0].seq)) {
+    if (ftruncate(r->fd, r->offset) < 0) {
+      uwsgi_error("ftruncate() failed");
+    }
+    r->stats->dropped += n;
+    return 0;
+  }
+
+  struct iovec index_iov = {.iov_base = index,
+                            .iov_len = n * sizeof(record_index_entry)};
+  if (pwritev_all(r->index_fd, &index_iov, 1, r->index_offset) < 0) {
+    uwsgi_error("pwritev() failed");
+    if (ftruncate(r->fd, r->offset) < 0) {
+      uwsgi_error("ftruncate() failed");
+    }
+    r->stats->dropped += n;
+    return -1;
+  }
+
+  r->stats->frames += n;
+  r->stats->bytes += offset - r->offset;
+  r->offset = offset;
+  r->index_offset += index_iov.iov_len;
+  return 0;
+}
+
+int capture_recorder_process(capture_recorder *r, capture_history *h) {
+  history_entry batch[RECORD_BATCH];
+  uint32_t n = capture_history_collect(h, r->last_seq, batch, RECORD_BATCH);
+  if (n == 0) {
+    return 0;
+  }
+
+  if (r->last_seq != 0 && batch[0].seq > r->last_seq + 1) {
+    // evicted from the history before we got to them
+    r->stats->dropped += batch[0].seq - r->last_seq - 1;
+  }
+  r->last_seq = batch[n - 1].seq;
+
+  uint32_t i = 0;
+  while (i < n) {
+    if (r->fd < 0 ||
+        batch[i].timestamp - r->segment_start >= r->segment_length) {
+      if (recorder_rotate(r, batch[i].timestamp) < 0) {
+        r->stats->dropped += n - i;
+        return -1;
+      }
+    }
+
+    uint32_t j = i + 1;
+    while (j < n && batch[j].timestamp - r->segment_start < r->segment_length) {
+      j++;
+    }
+    recorder_write(r, h, &batch[i], j - i);
+    i = j;
+  }
+
+  return 0;
+}
+
+// Find the first frame recorded at or after timestamp in a segment index,
+// returning its position in the index or -1 if there is none.
+int64_t capture_record_seek(char *index_path, uint64_t timestamp,
+                            record_index_entry *out) {
+  int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    uwsgi_error("could not open() recording index");
+    return -1;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(record_index_entry)) {
+    close(fd);
+    return -1;
+  }
+
+  record_index_entry *index = (record_index_entry *)mmap(
+      NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (index == MAP_FAILED) {
+    uwsgi_error("could not mmap() recording index");
+    return -1;
+  }
+
+  uint64_t lo = 0, hi = st.st_size / sizeof(record_index_entry);
+  uint64_t count = hi;
+  while (lo < hi) {
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (index[mid].timestamp < timestamp) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  int64_t ret = -1;
+  if (lo < count) {
+    *out = index[lo];
+    ret = lo;
+  }
+  munmap(index, st.st_size);
+  return ret;
+}
+
+// Find the recorded frames between since and until (uwsgi_micros() time) for
+// the recorder with the given id. They come from the segment that was being
+// written at since (or the oldest one, if since is older than that), so a
+// range never spans more than one segment. The segment's path and the byte
+// range within it are returned.
+int capture_record_locate(char *dir, int id, uint64_t since, uint64_t until,
+                          char *path, size_t path_size, uint64_t *offset,
+                          uint64_t *length) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    uwsgi_error("could not opendir() recording directory");
+    return -1;
+  }
+
+  bool found = false;
+  uint64_t best = 0, oldest = UINT64_MAX;
+  struct dirent *de;
+  while ((de = readdir(d)) != NULL) {
+    int file_id, end = 0;
+    uint64_t start;
+    int n = sscanf(de->d_name, "%d-%" SCNu64 ".idx%n", &file_id, &start, &end);
+    if (n != 2 || end == 0 || de->d_name[end] != 0 || file_id != id) {
+      continue;
+    }
+    if (start < oldest) {
+      oldest = start;
+    }
+    if (start <= since && (!found || start > best)) {
+      best = start;
+      found = true;
+    }
+  }
+  closedir(d);
+  if (!found) {
+    if (oldest == UINT64_MAX) {
+      return -1;
+    }
+    best = oldest;
+  }
+
+  char index_path[PATH_MAX];
+  snprintf(index_path, sizeof(index_path), "%s/%d-%" PRIu64 ".idx", dir, id,
+           best);
+  snprintf(path, path_size, "%s/%d-%" PRIu64 ".mjpeg", dir, id, best);
+
+  record_index_entry first, last;
+  if (capture_record_seek(index_path, since, &first) < 0 ||
+      first.timestamp > until) {
+    return -1;
+  }
+  uint64_t end;
+  if (until < UINT64_MAX &&
+      capture_record_seek(index_path, until + 1, &last) >= 0) {
+    end = last.offset;
+  } else {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+      uwsgi_error("could not stat() recording segment");
+      return -1;
+    }
+    end = st.st_size;
+  }
+
+  *offset = first.offset;
+  *length = end - first.offset;
+  return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "history.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define RECORD_BATCH 64
+#define RECORD_POLL_INTERVAL 20000
+#define RECORD_DEFAULT_SEGMENT 60
+
+// One of these is appended to a segment's .idx file for every frame written to
+// its .mjpeg file; the fixed size makes the index searchable in place.
+typedef struct {
+  uint64_t seq;
+  uint64_t timestamp;
+  uint64_t offset;
+  uint32_t length;
+  uint32_t reserved;
+} record_index_entry;
+
+typedef struct {
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t dropped;
+  uint64_t segments;
+} record_stats;
+
+typedef struct {
+  char *dir;
+  uint64_t segment_length;
+  int id;
+  record_stats *stats;
+
+  // only touched by the recording mule
+  uint64_t last_seq;
+  uint64_t segment_start;
+  uint64_t offset;
+  uint64_t index_offset;
+  int fd;
+  int index_fd;
+} capture_recorder;
+
+capture_recorder *capture_recorder_init(char *dir, uint32_t segment_seconds,
+                                        int id);
+void capture_recorder_free(capture_recorder *r);
+int capture_recorder_process(capture_recorder *r, capture_history *h);
+int64_t capture_record_seek(char *index_path, uint64_t timestamp,
+                            record_index_entry *out);
+int capture_record_locate(char *dir, int id, uint64_t since, uint64_t until,
+                          char *path, size_t path_size, uint64_t *offset,
+                          uint64_t *length);
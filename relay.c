@@ -0,0 +1,390 @@
+#include "relay.h"
+#include "pool.h"
+#include "util.h"
+#include "uwsgiwrap.h"
+#include "v4l.h"
+#include <arpa/inet.h>
+#include <endian.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Open a datagram socket for addr, which is either a Unix socket path (with a
+// leading @ for the abstract namespace) or an IPv4 host:port. Listening on a
+// multicast group joins it on every interface.
+int relay_socket(char *addr, bool listen, struct sockaddr_storage *ss,
+                 socklen_t *ss_len, uint16_t *chunk) {
+  int fd;
+  memset(ss, 0, sizeof(*ss));
+
+  if (addr[0] == '/' || addr[0] == '@') {
+    struct sockaddr_un *sun = (struct sockaddr_un *)ss;
+    size_t len = strlen(addr);
+    if (len >= sizeof(sun->sun_path)) {
+      uwsgi_log("relay socket path %s is too long\n", addr);
+      return -1;
+    }
+    sun->sun_family = AF_UNIX;
+    memcpy(sun->sun_path, addr, len);
+    if (addr[0] == '@') {
+      sun->sun_path[0] = 0;
+    }
+    *ss_len = offsetof(struct sockaddr_un, sun_path) + len;
+    *chunk = RELAY_UNIX_CHUNK;
+
+    fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      uwsgi_error("socket() failed");
+      return -1;
+    }
+    if (listen) {
+      if (addr[0] == '/') {
+        unlink(addr);
+      }
+      if (bind(fd, (struct sockaddr *)ss, *ss_len) < 0) {
+        uwsgi_error("bind() failed");
+        close(fd);
+        return -1;
+      }
+    }
+    return fd;
+  }
+
+  char *colon = strrchr(addr, ':');
+  if (colon == NULL) {
+    uwsgi_log("invalid relay address %s\n", addr);
+    return -1;
+  }
+
+  struct sockaddr_in *sin = (struct sockaddr_in *)ss;
+  sin->sin_family = AF_INET;
+  sin->sin_port = htons(atoi(colon + 1));
+  sin->sin_addr.s_addr = INADDR_ANY;
+  if (colon != addr) {
+    char *host = strndup(addr, colon - addr);
+    int ret = inet_pton(AF_INET, host, &sin->sin_addr);
+    free(host);
+    if (ret != 1) {
+      uwsgi_log("invalid relay address %s\n", addr);
+      return -1;
+    }
+  }
+  *ss_len = sizeof(*sin);
+  *chunk = RELAY_INET_CHUNK;
+
+  fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    uwsgi_error("socket() failed");
+    return -1;
+  }
+  if (!listen) {
+    return fd;
+  }
+
+  struct in_addr group = sin->sin_addr;
+  bool multicast = IN_MULTICAST(ntohl(group.s_addr));
+  if (multicast) {
+    // let several instances on this host receive the same group
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sin->sin_addr.s_addr = INADDR_ANY;
+  }
+  if (bind(fd, (struct sockaddr *)ss, *ss_len) < 0) {
+    uwsgi_error("bind() failed");
+    close(fd);
+    return -1;
+  }
+  if (multicast) {
+    struct ip_mreq mreq = {.imr_multiaddr = group,
+                           .imr_interface.s_addr = INADDR_ANY};
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) <
+        0) {
+      uwsgi_error("could not join multicast group");
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+relay_sender *relay_sender_init(char *addr, uint16_t stream) {
+  relay_sender *r = (relay_sender *)uwsgi_calloc_shared(sizeof(relay_sender));
+  r->fd = relay_socket(addr, false, &r->addr, &r->addr_len, &r->chunk);
+  if (r->fd < 0) {
+    return NULL;
+  }
+  r->stream = stream;
+  return r;
+}
+
+void relay_sender_free(relay_sender *r) {
+  close(r->fd);
+  capture_free_shared(r, sizeof(*r));
+}
+
+// Send a whole frame without blocking. The frame is sent straight out of its
+// buffer with sendmmsg(); if the socket can't take all of it, the rest is
+// dropped and the receiver throws away the partial frame.
+void relay_send(relay_sender *r, pool_slot *slot) {
+  struct mmsghdr msgs[RELAY_BATCH];
+  struct iovec iov[RELAY_BATCH][2];
+  relay_header hdr[RELAY_BATCH];
+
+  uint32_t offset = 0;
+  while (offset < slot->used) {
+    int n = 0;
+    for (; n < RELAY_BATCH && offset < slot->used; n++) {
+      uint32_t chunk = slot->used - offset;
+      if (chunk > r->chunk) {
+        chunk = r->chunk;
+      }
+
+      hdr[n].magic = htobe32(RELAY_MAGIC);
+      hdr[n].stream = htobe16(r->stream);
+      hdr[n].chunk = htobe16(chunk);
+      hdr[n].seq = htobe64(slot->seq);
+      hdr[n].timestamp = htobe64(slot->timestamp);
+      hdr[n].length = htobe32(slot->used);
+      hdr[n].offset = htobe32(offset);
+
+      iov[n][0].iov_base = &hdr[n];
+      iov[n][0].iov_len = sizeof(relay_header);
+      iov[n][1].iov_base = slot->data + offset;
+      iov[n][1].iov_len = chunk;
+
+      memset(&msgs[n], 0, sizeof(msgs[n]));
+      msgs[n].msg_hdr.msg_name = &r->addr;
+      msgs[n].msg_hdr.msg_namelen = r->addr_len;
+      msgs[n].msg_hdr.msg_iov = iov[n];
+      msgs[n].msg_hdr.msg_iovlen = 2;
+      offset += chunk;
+    }
+
+    if (sendmmsg(r->fd, msgs, n, MSG_DONTWAIT) < n) {
+      r->dropped++;
+      return;
+    }
+  }
+  r->sent++;
+}
+
+static uint32_t frame_chunks(relay_receiver *r, uint32_t length) {
+  return (length + r->chunk - 1) / r->chunk;
+}
+
+// receivers of every context receiving relayed frames, so streams relayed to
+// the same address can share its socket
+static relay_receiver *receivers = NULL;
+
+// Receive frames relayed from another instance into this context's pool. The
+// address may be prefixed with "<stream>@" to pick one of several cameras
+// relayed to the same address; streams are numbered by sharedarea id. Each
+// address is only listened on once per instance, however many streams are
+// picked out of it.
+int capture_ctx_remote_init(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  relay_receiver *r = (relay_receiver *)uwsgi_calloc(sizeof(relay_receiver));
+  r->slot = -1;
+
+  char *addr = config->path;
+  char *at = strchr(addr, '@');
+  if (at != NULL && at != addr) {
+    r->stream = atoi(addr);
+    addr = at + 1;
+  }
+
+  relay_receiver *shared = NULL;
+  for (relay_receiver *other = receivers; other != NULL; other = other->next) {
+    if (strcmp(other->addr, addr) != 0) {
+      continue;
+    }
+    if (other->stream == r->stream) {
+      uwsgi_log("stream %d from %s is already being received\n", r->stream,
+                addr);
+      free(r);
+      return -1;
+    }
+    shared = other;
+  }
+
+  if (shared != NULL) {
+    r->fd = shared->fd;
+    r->chunk = shared->chunk;
+  } else {
+    struct sockaddr_storage ss;
+    socklen_t ss_len;
+    r->fd = relay_socket(addr, true, &ss, &ss_len, &r->chunk);
+    if (r->fd < 0) {
+      uwsgi_log("Unable to listen for relayed frames on %s\n", config->path);
+      free(r);
+      return -1;
+    }
+  }
+  r->addr = strdup(addr);
+
+  config->buffers = capture_pool_buffers(config->buffers);
+  if (config->relay_max_frame == 0) {
+    config->relay_max_frame = RELAY_DEFAULT_MAX_FRAME;
+  }
+  r->arrived = (uint8_t *)uwsgi_calloc(
+      (frame_chunks(r, config->relay_max_frame) + 7) / 8);
+
+  ctx->pool = capture_pool_init(config->buffers);
+  char *area = (char *)uwsgi_malloc_shared((size_t)config->relay_max_frame *
+                                           config->buffers);
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    ctx->pool->slots[i].data = area + (size_t)i * config->relay_max_frame;
+    ctx->pool->slots[i].length = config->relay_max_frame;
+  }
+
+  ctx->sa = uwsgi_sharedarea_init_ptr(area, config->relay_max_frame);
+  // only the context that opened the socket waits on it
+  ctx->sa->fd = (shared == NULL) ? r->fd : -1;
+  ctx->sa->honour_used = 1;
+  ctx->pool->lock = ctx->sa->lock;
+  ctx->receiver = r;
+  capture_ctx_init_outputs(ctx);
+
+  r->next = receivers;
+  receivers = r;
+  uwsgi_log("receiving relayed frames from %s into sharedarea %d\n",
+            config->path, ctx->sa->id);
+  return 0;
+}
+
+// Stop receiving into r, closing its socket unless other streams are still
+// received through it.
+void relay_receiver_free(relay_receiver *r) {
+  bool shared = false;
+  for (relay_receiver **p = &receivers; *p != NULL;) {
+    if (*p == r) {
+      *p = r->next;
+      continue;
+    }
+    if ((*p)->fd == r->fd) {
+      shared = true;
+    }
+    p = &(*p)->next;
+  }
+  if (!shared) {
+    close(r->fd);
+  }
+  free(r->arrived);
+  free(r->addr);
+  free(r);
+}
+
+// the context receiving stream from the socket fd, if any
+static capture_context *relay_target(int fd, uint16_t stream,
+                                     capture_context *contexts,
+                                     uint8_t length) {
+  for (uint8_t i = 0; i < length; i++) {
+    relay_receiver *r = contexts[i].receiver;
+    if (contexts[i].sa != NULL && r != NULL && r->fd == fd &&
+        r->stream == stream) {
+      return &contexts[i];
+    }
+  }
+  return NULL;
+}
+
+// add a chunk received from the socket to the frame ctx is reassembling
+static void relay_receive_chunk(capture_context *ctx, relay_header *hdr,
+                                char *data) {
+  relay_receiver *r = ctx->receiver;
+  uint16_t chunk = be16toh(hdr->chunk);
+  uint64_t seq = be64toh(hdr->seq);
+  uint32_t length = be32toh(hdr->length);
+  uint32_t offset = be32toh(hdr->offset);
+
+  if (seq != r->seq) {
+    if (r->slot >= 0) {
+      // never got the rest of the previous frame
+      r->dropped++;
+    }
+    r->seq = seq;
+    r->slot = -1;
+    r->length = length;
+    r->received = 0;
+    memset(r->arrived, 0,
+           (frame_chunks(r, ctx->config->relay_max_frame) + 7) / 8);
+    for (uint8_t i = 0; i < ctx->pool->count; i++) {
+      if (capture_pool_reclaimable(ctx->pool, i)) {
+        r->slot = i;
+        break;
+      }
+    }
+    if (r->slot < 0) {
+      // every buffer is pinned
+      r->dropped++;
+    }
+  }
+  if (r->slot < 0) {
+    return;
+  }
+
+  // the sender splits frames at the same chunk size we would, so anything
+  // that isn't a whole chunk on a chunk boundary is corrupt
+  pool_slot *slot = &ctx->pool->slots[r->slot];
+  if (length != r->length || length > slot->length || offset >= length ||
+      chunk > length - offset || offset % r->chunk != 0 ||
+      (chunk != r->chunk && chunk != length - offset)) {
+    r->slot = -1;
+    r->dropped++;
+    return;
+  }
+
+  uint32_t index = offset / r->chunk;
+  uint8_t bit = 1 << (index % 8);
+  if (r->arrived[index / 8] & bit) {
+    return;
+  }
+  r->arrived[index / 8] |= bit;
+
+  memcpy(slot->data + offset, data, chunk);
+  if (++r->received == frame_chunks(r, length)) {
+    capture_ctx_publish(ctx, r->slot, length, 0, be64toh(hdr->timestamp));
+    r->slot = -1;
+  }
+}
+
+// Drain the socket ctx listens on, handing each chunk to whichever context
+// receives its stream.
+int capture_ctx_remote_receive(capture_context *ctx, capture_context *contexts,
+                               uint8_t length) {
+  relay_receiver *r = ctx->receiver;
+  while (true) {
+    ssize_t len = recv(r->fd, r->buf, sizeof(r->buf), MSG_DONTWAIT);
+    if (len < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return 0;
+      } else if (errno == EINTR) {
+        continue;
+      }
+      uwsgi_error("recv() failed");
+      return -1;
+    }
+
+    relay_header *hdr = (relay_header *)r->buf;
+    if ((size_t)len < sizeof(relay_header) ||
+        be32toh(hdr->magic) != RELAY_MAGIC ||
+        be16toh(hdr->chunk) > len - sizeof(relay_header)) {
+      continue;
+    }
+
+    uint16_t stream = be16toh(hdr->stream);
+    capture_context *target =
+        (stream == r->stream) ? ctx
+                              : relay_target(r->fd, stream, contexts, length);
+    if (target != NULL) {
+      relay_receive_chunk(target, hdr, r->buf + sizeof(relay_header));
+    }
+  }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include "pool.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RELAY_MAGIC 0x55574346
+#define RELAY_INET_CHUNK 1400
+#define RELAY_UNIX_CHUNK 32768
+#define RELAY_MAX_DATAGRAM 65536
+#define RELAY_BATCH 64
+#define RELAY_DEFAULT_MAX_FRAME (1024 * 1024)
+
+// Frames are relayed as a run of datagrams, each carrying one chunk of the
+// frame behind this header. All fields are big-endian on the wire.
+typedef struct {
+  uint32_t magic;
+  uint16_t stream;
+  uint16_t chunk;
+  uint64_t seq;
+  uint64_t timestamp;
+  uint32_t length;
+  uint32_t offset;
+} relay_header;
+
+typedef struct {
+  int fd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  uint16_t stream;
+  uint16_t chunk;
+  uint64_t sent;
+  uint64_t dropped;
+} relay_sender;
+
+// Every stream relayed to one address is received through a single socket,
+// opened by the first context receiving from it and shared with the rest.
+typedef struct relay_receiver {
+  char *addr;
+  int fd;
+  struct relay_receiver *next;
+  uint16_t stream;
+  uint16_t chunk;
+  uint64_t seq;
+  int slot;
+  uint32_t length;
+  // one bit per chunk of the frame being reassembled
+  uint8_t *arrived;
+  uint32_t received;
+  uint64_t dropped;
+  char buf[RELAY_MAX_DATAGRAM];
+} relay_receiver;
+
+int relay_socket(char *addr, bool listen, struct sockaddr_storage *ss,
+                 socklen_t *ss_len, uint16_t *chunk);
+relay_sender *relay_sender_init(char *addr, uint16_t stream);
+void relay_sender_free(relay_sender *r);
+void relay_send(relay_sender *r, pool_slot *slot);
+void relay_receiver_free(relay_receiver *r);
@@ -0,0 +1,583 @@
+#include "route.h"
+#include "capture.h"
+#include "decode.h"
+#include "notify.h"
+#include "pool.h"
+#include "uwsgiwrap.h"
+#include "v4l.h"
+#include <endian.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef UWSGI_ROUTING
+static uint64_t parse_seq(char *str, uint16_t len) {
+  uint64_t n = 0;
+  for (uint16_t i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+    n = n * 10 + (str[i] - '0');
+  }
+  return n;
+}
+
+static capture_context *route_ctx(struct wsgi_request *wsgi_req,
+                                  struct uwsgi_route *ur) {
+  capture_context *ctx;
+  if (ur->data != NULL) {
+    // a named route remembers which slot its context was last found in
+    uint8_t hint = ur->custom;
+    ctx = capture_ctx_find(ur->data, &hint);
+    ur->custom = hint;
+  } else {
+    ctx = capture_ctx_get(ur->custom);
+  }
+  if (ctx == NULL) {
+    uwsgi_404(wsgi_req);
+  }
+  return ctx;
+}
+
+// Wait (without blocking other async cores) until a sharedarea of ctx has been
+// updated past seq, returning false on timeout. The mule wakes us up when it
+// publishes, unless this core has no eventfd to be woken through and polls.
+static bool wait_for_update(struct wsgi_request *wsgi_req,
+                            capture_context *ctx, struct uwsgi_sharedarea *sa,
+                            uint64_t seq, uint64_t timeout) {
+  notify_waiter *w = capture_notify_waiter(wsgi_req);
+  uint64_t deadline = uwsgi_micros() + timeout;
+  while (__atomic_load_n(&sa->updates, __ATOMIC_ACQUIRE) <= seq) {
+    // keep the context from being suspended while we wait on it
+    capture_demand_touch(ctx->pool->demand);
+    uint64_t now = uwsgi_micros();
+    if (now >= deadline) {
+      return false;
+    }
+    uint64_t wait = deadline - now;
+    if (wait > CAPTURE_WAIT_TOUCH) {
+      wait = CAPTURE_WAIT_TOUCH;
+    }
+    if (w != NULL ? !capture_notify_wait(w, sa, seq, wait)
+                  : uwsgi.wait_milliseconds_hook(CAPTURE_WAIT_POLL) < 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool wait_for_frame(struct wsgi_request *wsgi_req,
+                           capture_context *ctx, uint64_t seq,
+                           uint64_t timeout) {
+  return wait_for_update(wsgi_req, ctx, ctx->sa, seq, timeout);
+}
+
+// Whether ctx's latest frame dates from before it, or one of the contexts it's
+// composed from, was suspended. Such a frame may be hours old, so it's worth
+// waiting a moment for the fresh one that's on its way.
+static bool frame_stale(capture_context *ctx) {
+  if (capture_demand_stale(ctx->pool->demand)) {
+    return true;
+  }
+  if (ctx->crop != NULL) {
+    capture_context *input = capture_ctx_get(ctx->crop->input);
+    return input != NULL && input->sa != NULL && frame_stale(input);
+  }
+  if (ctx->mosaic != NULL) {
+    for (uint8_t i = 0; i < ctx->mosaic->count; i++) {
+      capture_context *input = capture_ctx_get(ctx->mosaic->inputs[i]);
+      if (input != NULL && input->sa != NULL && frame_stale(input)) {
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static int snapshot_not_modified(struct wsgi_request *wsgi_req, char *etag,
+                                 int etag_len) {
+  if (uwsgi_response_prepare_headers(wsgi_req, "304 Not Modified", 16)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len);
+  uwsgi_response_write_headers_do(wsgi_req);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Serve the latest frame with its sequence number as the ETag. Clients that
+// already have it get a 304 without the frame being touched, and ?after=N
+// holds the request until a frame newer than N arrives.
+static int capture_route_snapshot(struct wsgi_request *wsgi_req,
+                                  struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  char etag[24];
+  uint16_t inm_len = 0;
+  char *inm = uwsgi_get_var(wsgi_req, "HTTP_IF_NONE_MATCH", 18, &inm_len);
+
+  uint16_t after_len = 0;
+  char *after = uwsgi_get_qs(wsgi_req, "after", 5, &after_len);
+  if (after != NULL &&
+      !wait_for_frame(wsgi_req, ctx, parse_seq(after, after_len),
+                      SNAPSHOT_WAIT_TIMEOUT)) {
+    // a 304 is only meaningful as an answer to a conditional request
+    if (inm == NULL) {
+      uwsgi_response_prepare_headers(wsgi_req, "204 No Content", 14);
+      uwsgi_response_write_headers_do(wsgi_req);
+      return UWSGI_ROUTE_BREAK;
+    }
+    int etag_len = snprintf(etag, sizeof(etag), "\"%" PRIu64 "\"",
+                            parse_seq(after, after_len));
+    return snapshot_not_modified(wsgi_req, etag, etag_len);
+  }
+
+  // a client polling with If-None-Match still wants frames, and has to wake a
+  // suspended context up just like one fetching them
+  capture_demand_touch(ctx->pool->demand);
+  uint64_t seq = __atomic_load_n(&ctx->sa->updates, __ATOMIC_ACQUIRE);
+  if (frame_stale(ctx)) {
+    // on timeout the old frame is still better than nothing
+    wait_for_frame(wsgi_req, ctx, seq, RESUME_WAIT_TIMEOUT);
+    seq = __atomic_load_n(&ctx->sa->updates, __ATOMIC_ACQUIRE);
+  }
+  int etag_len = snprintf(etag, sizeof(etag), "\"%" PRIu64 "\"", seq);
+  if (inm != NULL && inm_len == etag_len && !memcmp(inm, etag, etag_len)) {
+    return snapshot_not_modified(wsgi_req, etag, etag_len);
+  }
+
+  capture_frame frame;
+  if (capture_frame_pin(ctx->pool, &frame) < 0) {
+    uwsgi_response_prepare_headers(wsgi_req, "503 Service Unavailable", 23);
+    uwsgi_response_write_headers_do(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  // the frame may have moved on since we looked
+  etag_len = snprintf(etag, sizeof(etag), "\"%" PRIu64 "\"", frame.seq);
+  if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) {
+    goto end;
+  }
+  if (uwsgi_response_add_content_type(wsgi_req, "image/jpeg", 10)) {
+    goto end;
+  }
+  if (uwsgi_response_add_content_length(wsgi_req, frame.length)) {
+    goto end;
+  }
+  if (uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len)) {
+    goto end;
+  }
+  if (uwsgi_response_add_header(wsgi_req, "Cache-Control", 13, "no-cache",
+                                8)) {
+    goto end;
+  }
+  capture_frame_send(wsgi_req, &frame);
+
+end:
+  capture_frame_unpin(&frame);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Send a frame as one binary websocket message. The message framing is
+// written by hand so the frame doesn't need another copy to be put after it.
+static int websocket_send_frame(struct wsgi_request *wsgi_req,
+                                capture_frame *frame) {
+  char buf[10 + sizeof(websocket_header)];
+  uint64_t len = sizeof(websocket_header) + frame->length;
+  int n = 0;
+  buf[n++] = 0x82; // FIN, binary
+  if (len < 126) {
+    buf[n++] = len;
+  } else if (len <= 0xffff) {
+    buf[n++] = 126;
+    uint16_t be = htobe16(len);
+    memcpy(buf + n, &be, sizeof(be));
+    n += sizeof(be);
+  } else {
+    buf[n++] = 127;
+    uint64_t be = htobe64(len);
+    memcpy(buf + n, &be, sizeof(be));
+    n += sizeof(be);
+  }
+
+  websocket_header hdr = {.seq = htobe64(frame->seq),
+                          .timestamp = htobe64(frame->timestamp),
+                          .length = htobe32(frame->length),
+                          .reserved = 0};
+  memcpy(buf + n, &hdr, sizeof(hdr));
+  n += sizeof(hdr);
+
+  if (uwsgi_response_write_body_do(wsgi_req, buf, n)) {
+    return -1;
+  }
+  return capture_frame_send(wsgi_req, frame);
+}
+
+// Push every new frame to a websocket client for as long as it stays
+// connected. A client that can't keep up just gets the latest frame once it's
+// ready for another, and each client only costs an async core and a copy of
+// the frame it's being sent.
+static int capture_route_websocket(struct wsgi_request *wsgi_req,
+                                   struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  uint16_t key_len = 0, origin_len = 0, proto_len = 0;
+  char *key = uwsgi_get_var(wsgi_req, "HTTP_SEC_WEBSOCKET_KEY", 22, &key_len);
+  char *origin = uwsgi_get_var(wsgi_req, "HTTP_ORIGIN", 11, &origin_len);
+  char *proto =
+      uwsgi_get_var(wsgi_req, "HTTP_SEC_WEBSOCKET_PROTOCOL", 27, &proto_len);
+  if (key == NULL) {
+    uwsgi_response_prepare_headers(wsgi_req, "400 Bad Request", 15);
+    uwsgi_response_write_headers_do(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_websocket_handshake(wsgi_req, key, key_len, origin, origin_len,
+                                proto, proto_len)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  // subscribed clients keep the context streaming even between frames
+  capture_demand_subscribe(ctx->pool->demand);
+  // start from the first frame since resuming rather than the stale one
+  uint64_t seq = frame_stale(ctx)
+                     ? __atomic_load_n(&ctx->sa->updates, __ATOMIC_ACQUIRE)
+                     : 0;
+  char *copy = NULL;
+  uint32_t size = 0;
+  for (;;) {
+    // answers pings, and notices when the client goes away
+    struct uwsgi_buffer *ub = uwsgi_websocket_recv_nb(wsgi_req);
+    if (ub == NULL) {
+      break;
+    }
+    uwsgi_buffer_destroy(ub);
+
+    if (!wait_for_frame(wsgi_req, ctx, seq, WEBSOCKET_WAIT_TIMEOUT)) {
+      continue;
+    }
+
+    capture_frame frame;
+    if (capture_frame_pin(ctx->pool, &frame) < 0) {
+      continue;
+    }
+    seq = frame.seq;
+    // Sending blocks for as long as the client takes to read, and slow
+    // clients pinning every buffer would stall capture, so send a copy.
+    if (frame.length > size) {
+      free(copy);
+      copy = uwsgi_malloc(frame.length);
+      size = frame.length;
+    }
+    memcpy(copy, frame.data, frame.length);
+    capture_frame_unpin(&frame);
+    frame.data = copy;
+    frame.fd = -1;
+    if (websocket_send_frame(wsgi_req, &frame) < 0) {
+      break;
+    }
+  }
+  free(copy);
+  capture_demand_unsubscribe(ctx->pool->demand);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// ?seconds=N asks for the last N seconds; ?since= and ?until= take
+// uwsgi_micros() timestamps
+static void parse_range(struct wsgi_request *wsgi_req, uint64_t *since,
+                        uint64_t *until) {
+  uint16_t len = 0;
+  char *arg = uwsgi_get_qs(wsgi_req, "seconds", 7, &len);
+  if (arg != NULL) {
+    uint64_t now = uwsgi_micros();
+    uint64_t seconds = parse_seq(arg, len);
+    *since = (seconds < now / 1000000) ? now - seconds * 1000000 : 0;
+  }
+  arg = uwsgi_get_qs(wsgi_req, "since", 5, &len);
+  if (arg != NULL) {
+    *since = parse_seq(arg, len);
+  }
+  arg = uwsgi_get_qs(wsgi_req, "until", 5, &len);
+  if (arg != NULL) {
+    *until = parse_seq(arg, len);
+  }
+}
+
+static int clip_write(void *data, struct iovec *iov, int n) {
+  struct wsgi_request *wsgi_req = (struct wsgi_request *)data;
+  for (int i = 0; i < n; i++) {
+    if (uwsgi_response_write_body_do(wsgi_req, iov[i].iov_base,
+                                     iov[i].iov_len)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Stream the frames kept in a context's history as raw MJPEG, everything
+// there is unless a range is given.
+static int capture_route_clip(struct wsgi_request *wsgi_req,
+                              struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (ctx->history == NULL) {
+    uwsgi_404(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  uint64_t since = 0, until = UINT64_MAX;
+  parse_range(wsgi_req, &since, &until);
+
+  if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_response_add_content_type(wsgi_req, "video/x-motion-jpeg", 19)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_response_write_headers_do(wsgi_req)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  capture_history_export_to(ctx->history, since, until, clip_write, wsgi_req);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Serve recorded frames as raw MJPEG straight from the segment file, using
+// the same ?seconds=, ?since= and ?until= as capture-clip. A range is cut
+// short at the end of the segment it starts in.
+static int capture_route_playback(struct wsgi_request *wsgi_req,
+                                  struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (ctx->recorder == NULL) {
+    uwsgi_404(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  uint64_t since = 0, until = UINT64_MAX;
+  parse_range(wsgi_req, &since, &until);
+
+  char path[PATH_MAX];
+  uint64_t offset, length;
+  if (capture_record_locate(ctx->recorder->dir, ctx->recorder->id, since,
+                            until, path, sizeof(path), &offset,
+                            &length) < 0) {
+    uwsgi_404(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    uwsgi_error("could not open() recording segment");
+    uwsgi_404(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6) ||
+      uwsgi_response_add_content_type(wsgi_req, "video/x-motion-jpeg", 19) ||
+      uwsgi_response_add_content_length(wsgi_req, length)) {
+    close(fd);
+    return UWSGI_ROUTE_BREAK;
+  }
+  uwsgi_response_sendfile_do(wsgi_req, fd, offset, length);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Serve the raw planes of the latest frame back to back, in the layout of the
+// context's --decode format, straight out of the decoded buffer. Frames are
+// only decoded while someone wants them, so the first request in a while
+// waits for the latest frame to be decoded.
+static int capture_route_decoded(struct wsgi_request *wsgi_req,
+                                 struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  capture_decoded *d = ctx->decoded;
+  if (d == NULL) {
+    uwsgi_404(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  // the latest frame will do, unless it's been sitting there since a suspend
+  uint64_t seq = __atomic_load_n(&ctx->sa->updates, __ATOMIC_ACQUIRE);
+  if (!frame_stale(ctx) && seq > 0) {
+    seq--;
+  }
+  capture_decoded_touch(d);
+  capture_frame frame;
+  capture_planes planes;
+  if (!wait_for_update(wsgi_req, ctx, d->sa, seq, SNAPSHOT_WAIT_TIMEOUT) ||
+      capture_decoded_pin(d, &frame, &planes) < 0) {
+    uwsgi_response_prepare_headers(wsgi_req, "503 Service Unavailable", 23);
+    uwsgi_response_write_headers_do(wsgi_req);
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  char etag[24], width[11], height[11];
+  int etag_len = snprintf(etag, sizeof(etag), "\"%" PRIu64 "\"", planes.seq);
+  int width_len = snprintf(width, sizeof(width), "%" PRIu32, planes.width);
+  int height_len = snprintf(height, sizeof(height), "%" PRIu32, planes.height);
+  char *format = (d->format == DECODE_YUV420) ? "yuv420" : "gray";
+  if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6) ||
+      uwsgi_response_add_content_type(wsgi_req, "application/octet-stream",
+                                      24) ||
+      uwsgi_response_add_content_length(wsgi_req, frame.length) ||
+      uwsgi_response_add_header(wsgi_req, "ETag", 4, etag, etag_len) ||
+      uwsgi_response_add_header(wsgi_req, "X-Frame-Format", 14, format,
+                                strlen(format)) ||
+      uwsgi_response_add_header(wsgi_req, "X-Frame-Width", 13, width,
+                                width_len) ||
+      uwsgi_response_add_header(wsgi_req, "X-Frame-Height", 14, height,
+                                height_len) ||
+      uwsgi_response_add_header(wsgi_req, "Cache-Control", 13, "no-cache",
+                                8)) {
+    goto end;
+  }
+  capture_frame_send(wsgi_req, &frame);
+
+end:
+  capture_frame_unpin(&frame);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Report a context's counters as JSON.
+static int capture_route_stats(struct wsgi_request *wsgi_req,
+                               struct uwsgi_route *ur) {
+  capture_context *ctx = route_ctx(wsgi_req, ur);
+  if (ctx == NULL) {
+    return UWSGI_ROUTE_BREAK;
+  }
+
+  capture_demand *d = ctx->pool->demand;
+  char buf[1024];
+  int len = snprintf(
+      buf, sizeof(buf),
+      "{\"sharedarea\":%d,\"sequence\":%" PRIu64 ",\"streaming\":%s,"
+      "\"subscribers\":%d,\"idle_us\":%" PRIu64 ",\"suspends\":%" PRIu64
+      ",\"resumes\":%" PRIu64 ",\"resume_latency_us\":%" PRIu64 "",
+      ctx->sa->id, ctx->sa->updates, d->suspended ? "false" : "true",
+      d->subscribers, uwsgi_micros() - d->last_demand, d->suspends,
+      d->resumes, d->resume_latency);
+  if (ctx->rate != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"rate\":{\"budget\":%" PRIu64
+                    ",\"bytes_per_sec\":%" PRIu64
+                    ",\"quality\":%d,\"skip\":%d}",
+                    ctx->rate->budget, ctx->rate->rate, ctx->rate->quality,
+                    ctx->rate->skip);
+  }
+  if (ctx->history != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"history\":{\"frames\":%" PRIu32
+                    ",\"dropped\":%" PRIu64 "}",
+                    ctx->history->count, ctx->history->dropped);
+  }
+  if (ctx->recorder != NULL) {
+    record_stats *rs = ctx->recorder->stats;
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"record\":{\"frames\":%" PRIu64 ",\"bytes\":%" PRIu64
+                    ",\"dropped\":%" PRIu64 ",\"segments\":%" PRIu64 "}",
+                    rs->frames, rs->bytes, rs->dropped, rs->segments);
+  }
+  if (ctx->relay != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"relay\":{\"sent\":%" PRIu64 ",\"dropped\":%" PRIu64
+                    "}",
+                    ctx->relay->sent, ctx->relay->dropped);
+  }
+  if (ctx->mosaic != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"mosaic\":{\"reencoded\":%" PRIu64
+                    ",\"dropped\":%" PRIu64 "}",
+                    ctx->mosaic->reencoded, ctx->mosaic->dropped);
+  }
+  if (ctx->crop != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"crop\":{\"input\":%d,\"dropped\":%" PRIu64 "}",
+                    ctx->crop->input, ctx->crop->dropped);
+  }
+  if (ctx->decoded != NULL) {
+    len += snprintf(buf + len, sizeof(buf) - len,
+                    ",\"decoded\":{\"active\":%s,\"dropped\":%" PRIu64 "}",
+                    capture_decoded_wanted(ctx->decoded) ? "true" : "false",
+                    ctx->decoded->dropped);
+  }
+  len += snprintf(buf + len, sizeof(buf) - len, "}");
+
+  if (uwsgi_response_prepare_headers(wsgi_req, "200 OK", 6)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_response_add_content_type(wsgi_req, "application/json", 16)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  if (uwsgi_response_add_content_length(wsgi_req, len)) {
+    return UWSGI_ROUTE_BREAK;
+  }
+  uwsgi_response_write_body_do(wsgi_req, buf, len);
+  return UWSGI_ROUTE_BREAK;
+}
+
+// Routes pick their context by id, or by name since contexts don't exist yet
+// to resolve it against when routes are parsed.
+static int route_target(struct uwsgi_route *ur, char *args) {
+  size_t len = strlen(args);
+  if (len > 0 && strspn(args, "0123456789") == len) {
+    ur->custom = uwsgi_str_num(args, len);
+  } else {
+    ur->data = args;
+    ur->data_len = len;
+  }
+  return 0;
+}
+
+static int capture_router_stats(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_stats;
+  return route_target(ur, args);
+}
+
+static int capture_router_websocket(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_websocket;
+  return route_target(ur, args);
+}
+
+static int capture_router_playback(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_playback;
+  return route_target(ur, args);
+}
+
+static int capture_router_decoded(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_decoded;
+  return route_target(ur, args);
+}
+
+static int capture_router_clip(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_clip;
+  return route_target(ur, args);
+}
+
+static int capture_router_snapshot(struct uwsgi_route *ur, char *args) {
+  ur->func = capture_route_snapshot;
+  return route_target(ur, args);
+}
+#endif
+
+void capture_register_routers() {
+#ifdef UWSGI_ROUTING
+  uwsgi_register_router("capture-snapshot", capture_router_snapshot);
+  uwsgi_register_router("capture-stats", capture_router_stats);
+  uwsgi_register_router("capture-clip", capture_router_clip);
+  uwsgi_register_router("capture-playback", capture_router_playback);
+  uwsgi_register_router("capture-websocket", capture_router_websocket);
+  uwsgi_register_router("capture-decoded", capture_router_decoded);
+#endif
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+
+// how often cores without a notification eventfd check for frames, in ms
+#define CAPTURE_WAIT_POLL 10
+// how often waiting cores renew their demand for frames
+#define CAPTURE_WAIT_TOUCH 1000000
+#define SNAPSHOT_WAIT_TIMEOUT 30000000
+// how long a request to a suspended context waits for it to resume
+#define RESUME_WAIT_TIMEOUT 5000000
+// how often a quiet websocket checks for messages from the client
+#define WEBSOCKET_WAIT_TIMEOUT 1000000
+
+// Every frame pushed over a websocket is one binary message, starting with
+// this header. All fields are big-endian.
+typedef struct {
+  uint64_t seq;
+  uint64_t timestamp;
+  uint32_t length;
+  uint32_t reserved;
+} websocket_header;
+
+void capture_register_routers();
@@ -8,6 +8,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 
 // ioctl with a number of retries in the case of I/O failure
 int xioctl(int fd, int ctl, void *arg) {
@@ -26,6 +27,15 @@ int xioctl(int fd, int ctl, void *arg) {
   return (ret);
 }
 
+// uwsgi_malloc_shared() and uwsgi_calloc_shared() hand out anonymous shared
+// mappings, which can be given back with munmap(). Processes forked since keep
+// their own mapping until they drop it.
+void capture_free_shared(void *ptr, size_t size) {
+  if (ptr != NULL && munmap(ptr, size) < 0) {
+    uwsgi_error("munmap() failed");
+  }
+}
+
 void uwsgi_opt_set_8bit(char *opt, char *value, void *key) {
   uint8_t *ptr = (uint8_t *)key;
 
@@ -47,9 +57,38 @@ void uwsgi_opt_set_resolution(char *opt, char *value, void *key) {
   }
 }
 
-void uwsgi_opt_set_str_and_add_mule(char *opt, char *value, void *key) {
+void uwsgi_opt_set_decode_format(char *opt, char *value, void *key) {
+  uint8_t *format = (uint8_t *)key;
+
+  if (strcasecmp(value, "gray") == 0) {
+    *format = DECODE_GRAY;
+  } else if (strcasecmp(value, "yuv420") == 0) {
+    *format = DECODE_YUV420;
+  } else {
+    uwsgi_log("Invalid decode format '%s' specified\n", value);
+    exit(EXIT_FAILURE);
+  }
+}
+
+// one mule captures from every context, so only add it the first time
+void uwsgi_opt_add_string_list_and_add_mule(char *opt, char *value,
+                                            void *key) {
+  static bool mule_added = false;
+  uwsgi_opt_add_string_list(opt, value, key);
+  if (!mule_added) {
+    uwsgi_opt_add_mule(NULL, "capture_loop()", NULL);
+    mule_added = true;
+  }
+}
+
+// one mule records every context, so only add it the first time
+void uwsgi_opt_set_str_and_add_record_mule(char *opt, char *value, void *key) {
+  static bool mule_added = false;
   uwsgi_opt_set_str(opt, value, key);
-  uwsgi_opt_add_mule(NULL, "capture_loop()", NULL);
+  if (!mule_added) {
+    uwsgi_opt_add_mule(NULL, "capture_record_loop()", NULL);
+    mule_added = true;
+  }
 }
 
 void uwsgi_opt_set_ctrl_int(char *opt, char *value, void *key) {
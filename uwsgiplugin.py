@@ -1,2 +1,4 @@
 NAME="capture"
-GCC_LIST=["capture", "control", "module", "util", "v4l"]
+GCC_LIST=["capture", "control", "crop", "decode", "demand", "history", "jpeg", "module", "mosaic", "notify", "pool", "record", "relay", "route", "util", "v4l"]
+LIBS=["-ljpeg"]
+CFLAGS=["-D_GNU_SOURCE"]
@@ -1,81 +1,262 @@
 #include "v4l.h"
 #include "control.h"
+#include "notify.h"
 #include "util.h"
 #include "uwsgiwrap.h"
 #include <errno.h>
+#include <fcntl.h>
 #include <inttypes.h>
 #include <linux/videodev2.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/select.h>
 #include <unistd.h>
 
-static capture_context default_ctx = {.quality = 80,
-                                      .fps = 255,
-                                      .name = "Unknown",
-                                      .path = "/dev/video0",
-                                      .resolution = {640, 480},
-                                      .controls = NULL,
-                                      .control_count = 0,
-                                      .control_options.tvnorm =
-                                          V4L2_STD_UNKNOWN,
-                                      .sa = NULL};
+static capture_config default_config = {.quality = 80,
+                                        .fps = 255,
+                                        .name = "Unknown",
+                                        .path = "/dev/video0",
+                                        .resolution = {640, 480},
+                                        .controls = NULL,
+                                        .control_count = 0,
+                                        .record_dir = NULL,
+                                        .buffers = POOL_DEFAULT_BUFFERS,
+                                        .memfd = 0,
+                                        .relay_addr = NULL,
+                                        .decode_format = DECODE_NONE,
+                                        .decode_scale = 1,
+                                        .bandwidth = 0,
+                                        .control_options.tvnorm =
+                                            V4L2_STD_UNKNOWN};
+
+void capture_ctx_init(capture_context *ctx) {
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->source = CAPTURE_SOURCE_V4L;
+  ctx->config = (capture_config *)uwsgi_malloc(sizeof(capture_config));
+  *ctx->config = default_config;
+}
+
+static int v4l_mmap_buffers(capture_context *ctx, int fd) {
+  capture_config *config = ctx->config;
+  struct v4l2_requestbuffers rb;
+  memset(&rb, 0, sizeof(rb));
+  rb.count = config->buffers;
+  rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  rb.memory = V4L2_MEMORY_MMAP;
+
+  if (xioctl(fd, VIDIOC_REQBUFS, &rb) < 0 || rb.count < POOL_MIN_BUFFERS) {
+    uwsgi_log("Unable to allocate/mmap buffer for device %s\n", config->path);
+    return -1;
+  }
+  if (rb.count > POOL_MAX_BUFFERS) {
+    rb.count = POOL_MAX_BUFFERS;
+  }
+
+  ctx->pool = capture_pool_init(rb.count);
+  ctx->pool->memory = V4L2_MEMORY_MMAP;
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    struct v4l2_buffer vbuf;
+    memset(&vbuf, 0, sizeof(vbuf));
+    vbuf.index = i;
+    vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    vbuf.memory = V4L2_MEMORY_MMAP;
+    if (xioctl(fd, VIDIOC_QUERYBUF, &vbuf) < 0) {
+      uwsgi_log("Unable to query mmap'ed buffer for device %s\n", config->path);
+      return -1;
+    }
+
+    char *area = mmap(NULL, vbuf.length, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      fd, vbuf.m.offset);
+    if (area == MAP_FAILED) {
+      uwsgi_log("Unable to mmap buffer for device %s\n", config->path);
+      return -1;
+    }
+    ctx->pool->slots[i].data = area;
+    ctx->pool->slots[i].length = vbuf.length;
+  }
+  return 0;
+}
+
+// Have the driver capture straight into a sealed memfd, so frames can be
+// served with sendfile() without ever being copied.
+static int v4l_userptr_buffers(capture_context *ctx, int fd,
+                               uint32_t sizeimage) {
+  struct v4l2_requestbuffers rb;
+  memset(&rb, 0, sizeof(rb));
+  rb.count = ctx->config->buffers;
+  rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  rb.memory = V4L2_MEMORY_USERPTR;
+
+  if (sizeimage == 0 || xioctl(fd, VIDIOC_REQBUFS, &rb) < 0) {
+    return -1;
+  }
+  if (rb.count > POOL_MAX_BUFFERS) {
+    rb.count = POOL_MAX_BUFFERS;
+  }
+
+  if (rb.count < POOL_MIN_BUFFERS) {
+    goto release;
+  }
+
+  uint64_t slot_size = (sizeimage + uwsgi.page_size - 1) &
+                       ~((uint64_t)uwsgi.page_size - 1);
+  uint64_t memfd_size = slot_size * rb.count;
+  int memfd = memfd_create("capture", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    uwsgi_error("memfd_create() failed");
+    goto release;
+  }
+  if (ftruncate(memfd, memfd_size) < 0 ||
+      fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) <
+          0) {
+    uwsgi_error("could not size memfd");
+    close(memfd);
+    goto release;
+  }
+
+  char *area =
+      mmap(NULL, memfd_size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (area == MAP_FAILED) {
+    uwsgi_error("could not mmap() memfd");
+    close(memfd);
+    goto release;
+  }
+
+  ctx->pool = capture_pool_init(rb.count);
+  ctx->pool->memory = V4L2_MEMORY_USERPTR;
+  ctx->pool->fd = memfd;
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    ctx->pool->slots[i].data = area + i * slot_size;
+    ctx->pool->slots[i].offset = i * slot_size;
+    ctx->pool->slots[i].length = sizeimage;
+  }
+  return 0;
+
+release:
+  rb.count = 0;
+  xioctl(fd, VIDIOC_REQBUFS, &rb);
+  return -1;
+}
+
+static int v4l_queue_buffer(capture_pool *pool, int fd, uint8_t index) {
+  struct v4l2_buffer vbuf;
+  memset(&vbuf, 0, sizeof(vbuf));
+  vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  vbuf.memory = pool->memory;
+  vbuf.index = index;
+  if (pool->memory == V4L2_MEMORY_USERPTR) {
+    vbuf.m.userptr = (unsigned long)pool->slots[index].data;
+    vbuf.length = pool->slots[index].length;
+  }
+
+  if (xioctl(fd, VIDIOC_QBUF, &vbuf) < 0) {
+    return -1;
+  }
+  pool->slots[index].queued = true;
+  return 0;
+}
 
-void capture_ctx_init(capture_context *ctx) { *ctx = default_ctx; }
+// set up everything fed from the published frames, for any kind of source
+void capture_ctx_init_outputs(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  ctx->pool->demand = capture_demand_init();
+
+  if (config->history_size || config->history_seconds || config->record_dir) {
+    ctx->history = capture_history_init(config->history_size,
+                                        config->history_seconds * config->fps,
+                                        config->history_seconds * 1000000ULL);
+    uwsgi_log("keeping %" PRIu64 " bytes of frame history for %s\n",
+              ctx->history->arena_size, config->path);
+  }
+
+  if (config->record_dir != NULL) {
+    ctx->recorder = capture_recorder_init(config->record_dir,
+                                          config->record_segment, ctx->sa->id);
+    uwsgi_log("recording %s to %s\n", config->path, config->record_dir);
+  }
+
+  if (config->decode_format != DECODE_NONE) {
+    uint32_t width = config->resolution[0], height = config->resolution[1];
+    if (ctx->mosaic != NULL) {
+      width *= ctx->mosaic->columns;
+      height *= (ctx->mosaic->count + ctx->mosaic->columns - 1) /
+                ctx->mosaic->columns;
+    }
+    ctx->decoded = capture_decoded_init(config->decode_format,
+                                        config->decode_scale, width, height);
+    uwsgi_log("decoding %s on demand into sharedarea %d\n", config->path,
+              ctx->decoded->sa->id);
+  }
+
+  if (config->relay_addr != NULL) {
+    ctx->relay = relay_sender_init(config->relay_addr, ctx->sa->id);
+    if (ctx->relay == NULL) {
+      uwsgi_log("Unable to relay frames from %s to %s\n", config->path,
+                config->relay_addr);
+    } else {
+      uwsgi_log("relaying %s to %s as stream %d\n", config->path,
+                config->relay_addr, ctx->sa->id);
+    }
+  }
+}
 
 int capture_ctx_v4l_init(capture_context *ctx) {
-  if (ctx->quality > 100) {
-    ctx->quality = 100;
+  capture_config *config = ctx->config;
+  if (config->quality > 100) {
+    config->quality = 100;
   }
 
-  int fd = open(ctx->path, O_RDWR | O_NONBLOCK);
+  int fd = open(config->path, O_RDWR | O_NONBLOCK);
   if (fd == -1) {
-    uwsgi_log("Error opening V4L interface %s\n", ctx->path);
+    uwsgi_log("Error opening V4L interface %s\n", config->path);
     return -1;
   }
 
   struct v4l2_capability cap;
   memset(&cap, 0, sizeof(cap));
   if (xioctl(fd, VIDIOC_QUERYCAP, &cap) < 0) {
-    uwsgi_log("Error opening device %s: unable to query device.\n", ctx->path);
+    uwsgi_log("Error opening device %s: unable to query device.\n",
+              config->path);
     return -1;
   }
 
   if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE)) {
     uwsgi_log("Error opening device %s: video capture not supported.\n",
-              ctx->path);
+              config->path);
   }
 
   if (!(cap.capabilities & V4L2_CAP_STREAMING)) {
-    uwsgi_log("Device %s does not support streaming I/O\n", ctx->path);
+    uwsgi_log("Device %s does not support streaming I/O\n", config->path);
   }
 
   struct v4l2_format fmt;
   memset(&fmt, 0, sizeof(fmt));
   fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  fmt.fmt.pix.width = ctx->resolution[0];
-  fmt.fmt.pix.height = ctx->resolution[1];
+  fmt.fmt.pix.width = config->resolution[0];
+  fmt.fmt.pix.height = config->resolution[1];
   fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
   fmt.fmt.pix.field = V4L2_FIELD_ANY;
   if (xioctl(fd, VIDIOC_S_FMT, &fmt) < 0) {
     uwsgi_log("Unable to set pixel format MJPEG @ resolution %dx%d\n",
-              ctx->resolution[0], ctx->resolution[1]);
+              config->resolution[0], config->resolution[1]);
     return -1;
   }
 
-  if (fmt.fmt.pix.width != ctx->resolution[0] ||
-      fmt.fmt.pix.height != ctx->resolution[1]) {
+  if (fmt.fmt.pix.width != config->resolution[0] ||
+      fmt.fmt.pix.height != config->resolution[1]) {
     uwsgi_log("Specified resolution is unavailable, using %dx%d instead\n",
               fmt.fmt.pix.width, fmt.fmt.pix.height);
-    ctx->resolution[0] = fmt.fmt.pix.width;
-    ctx->resolution[1] = fmt.fmt.pix.height;
+    config->resolution[0] = fmt.fmt.pix.width;
+    config->resolution[1] = fmt.fmt.pix.height;
   }
 
   if (fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG &&
       fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_JPEG) {
-    uwsgi_log("Device %s does not support native MJPEG encoding\n", ctx->path);
+    uwsgi_log("Device %s does not support native MJPEG encoding\n",
+              config->path);
     return -1;
   }
 
@@ -85,78 +266,76 @@ int capture_ctx_v4l_init(capture_context *ctx) {
 
   if (xioctl(fd, VIDIOC_G_PARM, &setfps) < 0 ||
       !(setfps.parm.capture.capability & V4L2_CAP_TIMEPERFRAME)) {
-    uwsgi_log("Can't change FPS for device %s\n", ctx->path);
+    uwsgi_log("Can't change FPS for device %s\n", config->path);
   } else {
     memset(&setfps, 0, sizeof(setfps));
     setfps.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
     setfps.parm.capture.timeperframe.numerator = 1;
-    setfps.parm.capture.timeperframe.denominator = ctx->fps;
+    setfps.parm.capture.timeperframe.denominator = config->fps;
 
     if (xioctl(fd, VIDIOC_S_PARM, &setfps)) {
-      uwsgi_log("Can't set FPS of device %s\n", ctx->path);
+      uwsgi_log("Can't set FPS of device %s\n", config->path);
     }
   }
 
-  struct v4l2_requestbuffers rb;
-  memset(&rb, 0, sizeof(rb));
-  rb.count = 1;
-  rb.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  rb.memory = V4L2_MEMORY_MMAP;
+  config->buffers = capture_pool_buffers(config->buffers);
 
-  if (xioctl(fd, VIDIOC_REQBUFS, &rb) < 0) {
-    uwsgi_log("Unable to allocate/mmap buffer for device %s\n", ctx->path);
-    return -1;
+  ctx->pool = NULL;
+  if (config->memfd &&
+      v4l_userptr_buffers(ctx, fd, fmt.fmt.pix.sizeimage) < 0) {
+    uwsgi_log("Device %s can't capture into a memfd, using mmap instead\n",
+              config->path);
   }
-
-  struct v4l2_buffer vbuf;
-  memset(&vbuf, 0, sizeof(vbuf));
-  vbuf.index = 0;
-  vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  vbuf.memory = V4L2_MEMORY_MMAP;
-  if (xioctl(fd, VIDIOC_QUERYBUF, &vbuf) < 0) {
-    uwsgi_log("Unable to query mmap'ed buffer for device %s\n", ctx->path);
+  if (ctx->pool == NULL && v4l_mmap_buffers(ctx, fd) < 0) {
     return -1;
   }
 
-  uint64_t area_len = vbuf.length;
-  char *area = mmap(NULL, vbuf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
-                    vbuf.m.offset);
-
-  ctx->sa = uwsgi_sharedarea_init_ptr(area, area_len);
+  // the sharedarea always points at the latest frame in the pool
+  ctx->sa = uwsgi_sharedarea_init_ptr(ctx->pool->slots[0].data,
+                                      ctx->pool->slots[0].length);
   ctx->sa->fd = fd;
   ctx->sa->honour_used = 1;
+  ctx->pool->lock = ctx->sa->lock;
 
-  memset(&vbuf, 0, sizeof(vbuf));
-  vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  vbuf.memory = V4L2_MEMORY_MMAP;
-  vbuf.index = 0;
+  capture_ctx_init_outputs(ctx);
 
-  if (xioctl(fd, VIDIOC_QBUF, &vbuf) < 0) {
-    uwsgi_log("unable to queue mmap'ed buffer for device %s\n", ctx->path);
-    return -1;
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    if (v4l_queue_buffer(ctx->pool, fd, i) < 0) {
+      uwsgi_log("unable to queue buffer for device %s\n", config->path);
+      return -1;
+    }
   }
 
   struct v4l2_input in_struct;
   memset(&in_struct, 0, sizeof(in_struct));
   in_struct.index = 0;
   if (!xioctl(fd, VIDIOC_ENUMINPUT, &in_struct)) {
-    ctx->name = strdup((const char *)in_struct.name);
+    free(config->name);
+    config->name = strdup((const char *)in_struct.name);
   }
 
   v4l_enumerate_controls(ctx);
   int ret = v4l_setup_controls(ctx);
   if (ret < 0) {
-    uwsgi_log("Failed to set up V4L2 controls for device %s\n", ctx->path);
+    uwsgi_log("Failed to set up V4L2 controls for device %s\n", config->path);
     return ret;
   }
 
+  if (config->bandwidth != 0) {
+    ctx->rate = (capture_rate *)uwsgi_calloc_shared(sizeof(capture_rate));
+    ctx->rate->budget = config->bandwidth;
+    ctx->rate->quality = config->quality;
+    uwsgi_log("keeping %s under %" PRIu64 " bytes per second\n", config->path,
+              config->bandwidth);
+  }
+
   int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   if (xioctl(fd, VIDIOC_STREAMON, &type) < 0) {
-    uwsgi_log("Unable to start capture stream for device %s\n", ctx->path);
+    uwsgi_log("Unable to start capture stream for device %s\n", config->path);
     return -1;
   }
 
-  uwsgi_log("%s started streaming frames to sharedarea %d\n", ctx->path,
+  uwsgi_log("%s started streaming frames to sharedarea %d\n", config->path,
             ctx->sa->id);
 
   return 0;
@@ -167,9 +346,15 @@ int capture_ctx_v4l_shutdown(capture_context *ctx) {
     return 0;
   }
 
+  if (ctx->source != CAPTURE_SOURCE_V4L) {
+    // a relay socket may be shared, so it's left to relay_receiver_free()
+    return 0;
+  }
+
   int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
   if (xioctl(ctx->sa->fd, VIDIOC_STREAMOFF, &type) < 0) {
-    uwsgi_log("Unable to stop capture stream for device %s\n", ctx->path);
+    uwsgi_log("Unable to stop capture stream for device %s\n",
+              ctx->config->path);
     return -1;
   }
 
@@ -177,19 +362,207 @@ int capture_ctx_v4l_shutdown(capture_context *ctx) {
   return 0;
 }
 
+// Release everything a context holds once capture_ctx_v4l_shutdown() has
+// stopped it, config included. uwsgi has no way to unregister a sharedarea,
+// so the sharedarea and the frame buffers behind it stay.
+void capture_ctx_free(capture_context *ctx) {
+  if (ctx->recorder != NULL) {
+    capture_recorder_free(ctx->recorder);
+  }
+  if (ctx->history != NULL) {
+    capture_history_free(ctx->history);
+  }
+  if (ctx->decoded != NULL) {
+    capture_decoded_free(ctx->decoded);
+  }
+  if (ctx->relay != NULL) {
+    relay_sender_free(ctx->relay);
+  }
+  if (ctx->receiver != NULL) {
+    relay_receiver_free(ctx->receiver);
+  }
+  capture_free_shared(ctx->mosaic, sizeof(capture_mosaic));
+  capture_free_shared(ctx->crop, sizeof(capture_crop));
+  capture_free_shared(ctx->rate, sizeof(capture_rate));
+  if (ctx->pool != NULL) {
+    capture_pool_free(ctx->pool);
+  }
+  free(ctx->config->controls);
+  free(ctx->config->name);
+  free(ctx->config);
+}
+
+// Make the frame in the given pool buffer the latest one, and pass it on to
+// everything that consumes frames as they arrive. seq is 0 to number the frame
+// after the last one, or the number of the frame this one was derived from.
+void capture_ctx_publish(capture_context *ctx, uint8_t index, uint32_t used,
+                         uint64_t seq, uint64_t timestamp) {
+  pool_slot *slot = &ctx->pool->slots[index];
+  uwsgi_wlock(ctx->sa->lock);
+  ctx->sa->updates = (seq != 0) ? seq : ctx->sa->updates + 1;
+  slot->used = used;
+  slot->seq = ctx->sa->updates;
+  slot->timestamp = timestamp;
+  ctx->pool->latest = index;
+  ctx->sa->area = slot->data;
+  ctx->sa->used = (uint64_t)used;
+  uwsgi_rwunlock(ctx->sa->lock);
+  capture_notify_publish(ctx->sa);
+
+  if (ctx->history != NULL) {
+    capture_history_append(ctx->history, slot->data, slot->used, slot->seq,
+                           slot->timestamp);
+  }
+  capture_demand_published(ctx->pool->demand, timestamp);
+  if (ctx->decoded != NULL) {
+    capture_decoded_update(ctx->decoded, slot);
+  }
+  if (ctx->relay != NULL) {
+    relay_send(ctx->relay, slot);
+  }
+}
+
+// hand every buffer nobody is reading anymore back to the driver
+static int capture_ctx_requeue(capture_context *ctx) {
+  for (uint8_t i = 0; i < ctx->pool->count; i++) {
+    if (capture_pool_reclaimable(ctx->pool, i) &&
+        v4l_queue_buffer(ctx->pool, ctx->sa->fd, i) < 0) {
+      uwsgi_error("ioctl() failed");
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Recording and relaying consume every frame, so contexts doing either are
+// never idle; everyone else has to ask for frames to keep them coming.
+static bool capture_ctx_idle(capture_context *ctx) {
+  if (ctx->idle_timeout == 0 || ctx->recorder != NULL || ctx->relay != NULL) {
+    return false;
+  }
+  if (ctx->decoded != NULL && capture_decoded_wanted(ctx->decoded)) {
+    return false;
+  }
+  return capture_demand_idle(ctx->pool->demand,
+                             ctx->idle_timeout * 1000000ULL);
+}
+
+// Whether anyone has asked a composite for frames lately. Only then are its
+// inputs asked in turn, so they can still go idle while it's unwatched.
+bool capture_ctx_wanted(capture_context *ctx) {
+  uint64_t timeout = ctx->idle_timeout ? ctx->idle_timeout * 1000000ULL
+                                       : COMPOSITE_IDLE_TIMEOUT;
+  return !capture_demand_idle(ctx->pool->demand, timeout);
+}
+
+// Stop streaming, keeping the buffers and controls set up so resuming only
+// takes a STREAMON. The latest frame stays readable in the meantime.
+static int capture_ctx_suspend(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  if (ctx->source == CAPTURE_SOURCE_V4L) {
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(ctx->sa->fd, VIDIOC_STREAMOFF, &type) < 0) {
+      uwsgi_log("Unable to stop capture stream for device %s\n", config->path);
+      return -1;
+    }
+    // STREAMOFF hands every buffer back to us
+    for (uint8_t i = 0; i < ctx->pool->count; i++) {
+      ctx->pool->slots[i].queued = false;
+    }
+  }
+
+  capture_demand_suspended(ctx->pool->demand, true);
+  uwsgi_log("suspended %s after %" PRIu32 " seconds without demand\n",
+            config->path, ctx->idle_timeout);
+  return 0;
+}
+
+static int capture_ctx_resume(capture_context *ctx) {
+  capture_config *config = ctx->config;
+  if (ctx->source == CAPTURE_SOURCE_V4L) {
+    if (capture_ctx_requeue(ctx) < 0) {
+      return -1;
+    }
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (xioctl(ctx->sa->fd, VIDIOC_STREAMON, &type) < 0) {
+      uwsgi_log("Unable to restart capture stream for device %s\n",
+                config->path);
+      return -1;
+    }
+  }
+
+  if (ctx->rate != NULL) {
+    // the time spent suspended doesn't count towards the budget
+    ctx->rate->window_start = 0;
+    ctx->rate->window_bytes = 0;
+  }
+  capture_demand_suspended(ctx->pool->demand, false);
+  uwsgi_log("resumed %s\n", config->path);
+  return 0;
+}
+
 int capture_ctx_process(capture_context *contexts, uint8_t length) {
   int ret, maxfd = 0;
   fd_set readset;
+  struct timeval timeout;
+  bool starved = false;
+  bool polling = false;
+
+  for (uint8_t i = 0; i < length; i++) {
+    capture_context *ctx = &contexts[i];
+    if (ctx->idle_timeout == 0 || ctx->source == CAPTURE_SOURCE_REMOTE) {
+      continue;
+    }
+    polling = true;
+
+    bool idle = capture_ctx_idle(ctx);
+    if (idle && !ctx->pool->demand->suspended) {
+      if (capture_ctx_suspend(ctx) < 0) {
+        return -1;
+      }
+    } else if (!idle && ctx->pool->demand->suspended) {
+      if (capture_ctx_resume(ctx) < 0) {
+        return -1;
+      }
+    }
+  }
+
+  int wake_fd = capture_demand_wake_fd();
+  bool waiting;
   do {
+    waiting = false;
     FD_ZERO(&readset);
+    if (polling && wake_fd >= 0) {
+      FD_SET(wake_fd, &readset);
+      maxfd = wake_fd;
+      waiting = true;
+    }
     for (uint8_t i = 0; i < length; i++) {
+      if (contexts[i].sa == NULL) {
+        continue;
+      }
       int fd = contexts[i].sa->fd;
+      if (fd < 0 || contexts[i].pool->demand->suspended) {
+        // a device that isn't streaming would never stop being readable
+        continue;
+      }
       FD_SET(fd, &readset);
+      waiting = true;
       if (fd > maxfd) {
         maxfd = fd;
       }
+      if (contexts[i].source == CAPTURE_SOURCE_V4L &&
+          capture_pool_queued(contexts[i].pool) == 0) {
+        // every buffer is pinned, so the device will never become readable;
+        // wake up regularly to hand buffers back as they're unpinned
+        starved = true;
+      }
     }
-    ret = select(maxfd + 1, &readset, NULL, NULL, NULL);
+    timeout.tv_sec = 0;
+    timeout.tv_usec = starved ? POOL_STARVED_POLL : DEMAND_POLL;
+    // never block for good when there's no fd to wake us up
+    ret = select(maxfd + 1, &readset, NULL, NULL,
+                 (starved || polling || !waiting) ? &timeout : NULL);
   } while (ret == -1 && errno == EINTR);
 
   if (ret < 0) {
@@ -197,30 +570,67 @@ int capture_ctx_process(capture_context *contexts, uint8_t length) {
     return -1;
   }
 
+  if (polling && wake_fd >= 0 && FD_ISSET(wake_fd, &readset)) {
+    // somebody wants a suspended context back; the next round resumes it
+    uint64_t wakeups;
+    if (read(wake_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+      uwsgi_error("read() from capture wakeup eventfd failed");
+    }
+  }
+
   for (uint8_t i = 0; i < length; i++) {
     capture_context *ctx = &contexts[i];
+    if (ctx->sa == NULL || ctx->source == CAPTURE_SOURCE_MOSAIC ||
+        ctx->source == CAPTURE_SOURCE_CROP || ctx->pool->demand->suspended) {
+      continue;
+    } else if (ctx->source == CAPTURE_SOURCE_REMOTE) {
+      // contexts sharing another's socket are fed when it's read
+      if (ctx->sa->fd >= 0 && FD_ISSET(ctx->sa->fd, &readset) &&
+          capture_ctx_remote_receive(ctx, contexts, length) < 0) {
+        return -1;
+      }
+      continue;
+    }
+
     if (FD_ISSET(ctx->sa->fd, &readset)) {
       struct v4l2_buffer vbuf;
       memset(&vbuf, 0, sizeof(vbuf));
       vbuf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-      vbuf.memory = V4L2_MEMORY_MMAP;
+      vbuf.memory = ctx->pool->memory;
 
       // dequeue buf
-      uwsgi_wlock(ctx->sa->lock);
       if (xioctl(ctx->sa->fd, VIDIOC_DQBUF, &vbuf) < 0) {
         uwsgi_error("ioctl() failed");
         return -1;
       }
-      ctx->sa->updates++;
-      ctx->sa->used = (uint64_t)vbuf.bytesused;
-      uwsgi_rwunlock(ctx->sa->lock);
-
-      // re-enqueue buf
-      if (xioctl(ctx->sa->fd, VIDIOC_QBUF, &vbuf) < 0) {
-        uwsgi_error("ioctl() failed");
-        return -1;
+      ctx->pool->slots[vbuf.index].queued = false;
+      uint64_t now = uwsgi_micros();
+      // frames skipped to stay within budget go straight back to the driver
+      if (ctx->rate == NULL || v4l_adapt_quality(ctx, vbuf.bytesused, now)) {
+        capture_ctx_publish(ctx, vbuf.index, vbuf.bytesused, 0, now);
       }
     }
+
+    if (capture_ctx_requeue(ctx) < 0) {
+      return -1;
+    }
+  }
+
+  // composite contexts go last, so they see this round's frames
+  for (uint8_t i = 0; i < length; i++) {
+    if (contexts[i].source == CAPTURE_SOURCE_MOSAIC &&
+        !contexts[i].pool->demand->suspended &&
+        capture_ctx_mosaic_process(&contexts[i], contexts, length) < 0) {
+      return -1;
+    }
+  }
+  // crops can be cut out of mosaics, so they go after them
+  for (uint8_t i = 0; i < length; i++) {
+    if (contexts[i].source == CAPTURE_SOURCE_CROP &&
+        !contexts[i].pool->demand->suspended &&
+        capture_ctx_crop_process(&contexts[i], contexts, length) < 0) {
+      return -1;
+    }
   }
 
   return 0;
@@ -1,5 +1,12 @@
 #pragma once
 
+#include "crop.h"
+#include "decode.h"
+#include "history.h"
+#include "mosaic.h"
+#include "pool.h"
+#include "record.h"
+#include "relay.h"
 #include "uwsgiwrap.h"
 #include <linux/videodev2.h>
 #include <stdbool.h>
@@ -30,6 +37,34 @@ typedef struct {
   v4l2_std_id tvnorm;
 } control_options;
 
+#define RATE_WINDOW 1000000
+#define RATE_MIN_QUALITY 10
+#define RATE_QUALITY_STEP 5
+#define RATE_MAX_SKIP 15
+
+typedef struct {
+  uint64_t budget;
+  uint64_t rate;
+  uint64_t window_start;
+  uint64_t window_bytes;
+  uint8_t quality;
+  // the device has no quality control, so only skipping frames is left
+  bool fixed_quality;
+  uint8_t skip;
+  uint32_t skipped;
+} capture_rate;
+
+#define CAPTURE_SOURCE_V4L 0
+#define CAPTURE_SOURCE_REMOTE 1
+#define CAPTURE_SOURCE_MOSAIC 2
+#define CAPTURE_SOURCE_CROP 3
+
+// how long a mosaic or crop keeps asking its inputs for frames after someone
+// last asked it for one, unless its own --idle-timeout is set
+#define COMPOSITE_IDLE_TIMEOUT 5000000
+
+// Everything about a context that's only needed to set it up or to change its
+// settings, kept out of the way of the per-frame loop.
 typedef struct {
   uint16_t quality, fps;
   char *name;
@@ -38,11 +73,54 @@ typedef struct {
   control_options control_options;
   v4l_control_meta *controls;
   int control_count;
+  uint64_t history_size;
+  uint32_t history_seconds;
+  char *record_dir;
+  uint32_t record_segment;
+  uint8_t buffers;
+  int memfd;
+  char *relay_addr;
+  uint32_t relay_max_frame;
+  uint8_t decode_format;
+  uint8_t decode_scale;
+  uint64_t bandwidth;
+} capture_config;
+
+// What capture_ctx_process() looks at for every frame. A context whose sa is
+// NULL is an empty slot.
+typedef struct {
+  uint8_t source;
+  uint32_t idle_timeout;
   struct uwsgi_sharedarea *sa;
+  capture_pool *pool;
+  capture_rate *rate;
+  capture_history *history;
+  capture_decoded *decoded;
+  relay_sender *relay;
+  relay_receiver *receiver;
+  capture_mosaic *mosaic;
+  capture_crop *crop;
+  capture_recorder *recorder;
+  capture_config *config;
 } capture_context;
 
 void capture_ctx_init(capture_context *ctx);
 
+void capture_ctx_init_outputs(capture_context *ctx);
+void capture_ctx_publish(capture_context *ctx, uint8_t index, uint32_t used,
+                         uint64_t seq, uint64_t timestamp);
+
 int capture_ctx_v4l_init(capture_context *ctx);
+int capture_ctx_remote_init(capture_context *ctx);
+int capture_ctx_remote_receive(capture_context *ctx, capture_context *contexts,
+                               uint8_t length);
+int capture_ctx_mosaic_init(capture_context *ctx);
+int capture_ctx_mosaic_process(capture_context *ctx,
+                               capture_context *contexts, uint8_t length);
+int capture_ctx_crop_init(capture_context *ctx);
+int capture_ctx_crop_process(capture_context *ctx, capture_context *contexts,
+                             uint8_t length);
+bool capture_ctx_wanted(capture_context *ctx);
 int capture_ctx_v4l_shutdown(capture_context *ctx);
+void capture_ctx_free(capture_context *ctx);
 int capture_ctx_process(capture_context *contexts, uint8_t length);